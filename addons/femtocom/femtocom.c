@@ -9,66 +9,16 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
 
-#define SERIAL_LINEBUF_SIZE 512
+#include "libfreqmeter.h"
+
+#define SERIAL_BUF_SIZE 4096
+#define INPUT_BUF_SIZE  256
 
 static struct termios ttysave;
 static bool ttysave_valid = false;
 
-static void serial_close(int fd) {
-  int result = -1;
-
-  if (fd > 0) {
-    do {
-      result = close(fd);
-    } while (result == -1 && errno == EINTR);
-  }
-}
-
-static int serial_open(const char *device_path) {
-  int fd = -1;
-
-  /* NULL or empty string. */
-  if (!device_path || !*device_path) {
-    return -EINVAL;
-  }
-
-  do {
-    fd = open(device_path, O_RDWR | O_NOCTTY);
-  } while (fd == -1 && errno == EINTR);
-
-  if (fd < 0) {
-    /* Failed to open file. */
-    return fd;
-  }
-
-  if (ioctl(fd, TIOCEXCL)) {
-    /* Failed to set IO exclusive, close it. */
-    serial_close(fd);
-    return -EIO;
-  }
-
-  /* Basic serial IO setup. */
-  /* Most common config. USB CDC without real serial does not care anyway. */
-  struct termios tio = {
-    .c_cflag = B115200 | CS8 | CLOCAL | CREAD,
-    .c_iflag = 0,
-    .c_oflag = 0,
-    .c_lflag = NOFLSH,
-    .c_cc = {0},
-  };
-  tio.c_cc[VMIN]  = 1; /* Wait until 1 char available (blocking read). */
-  tio.c_cc[VTIME] = 1; /* Give up after 100ms.                         */
-
-  if (tcsetattr(fd, TCSANOW, &tio)) {
-    /* Failed to apply settings. */
-    return -1;
-  } else {
-    tcflush(fd, TCIFLUSH);
-    return fd;
-  }
-}
-
 static int term_setup(void) {
   /* Setup local terminal. */
   struct termios ttystate;
@@ -81,7 +31,8 @@ static int term_setup(void) {
   ttysave_valid = true;
 
   ttystate.c_lflag &= ~(ICANON | ECHO);
-  ttystate.c_cc[VMIN] = 0; /* Non-blocking. */
+  ttystate.c_cc[VMIN]  = 1; /* Only read after poll(), so this never blocks. */
+  ttystate.c_cc[VTIME] = 0;
 
   if (tcsetattr(STDIN_FILENO, TCSANOW, &ttystate)) {
     return -1;
@@ -90,6 +41,25 @@ static int term_setup(void) {
   return 0;
 }
 
+/* Writes everything, retrying on partial writes and signals. */
+static int write_all(int fd, const char *buf, size_t len) {
+  ssize_t ret;
+
+  while (len) {
+    ret = write(fd, buf, len);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf += ret;
+    len -= ret;
+  }
+
+  return 0;
+}
+
 static void sig_handler(int signo) {
   /* Restore handlers first, so user can force quit. */
   signal(signo, SIG_DFL);
@@ -128,43 +98,71 @@ int main(int argc, char *argv[]) {
   }
 
   int  serial_fd = -1;
-  serial_fd = serial_open(argv[1]);
+  serial_fd = fm_serial_open(argv[1]);
   if (serial_fd < 0) {
     perror("Error opening serial port");
     return errno;
   }
 
-  char buf[SERIAL_LINEBUF_SIZE];
-  ssize_t len;
-  int c, in;
+  /* Sleep until either side has something, then move it all across in one go. */
+  struct pollfd fds[2] = {
+    {.fd = STDIN_FILENO, .events = POLLIN},
+    {.fd = serial_fd,    .events = POLLIN},
+  };
+  char buf[SERIAL_BUF_SIZE];
+  ssize_t len, i;
   while (true) {
-    /* Handle user input first.                      */
-    /* Drain excessive inputs and keep the last one. */
-    in = EOF;
-    while (EOF != (c = getchar())) {
-      in = c;
-    }
-    if (EOF != in) {
-      write(serial_fd, &in, 1);
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Error polling");
+      break;
     }
 
-    /* Reserve space for '\0'. */
-    len = read(serial_fd, buf, SERIAL_LINEBUF_SIZE - 1);
-    if (len < 0) {
-      perror("Error reading serial port");
-      break;
+    /*
+     * Handle user input first, every keystroke is forwarded as is. One byte per write, and so per USB packet:
+     * firmware before the whole-packet fix in usbcdc_getc() keeps only the first byte of each.
+     */
+    if (fds[0].revents & POLLIN) {
+      len = read(STDIN_FILENO, buf, INPUT_BUF_SIZE);
+      if (len <= 0) {
+        /* EOF or error on our own terminal, nothing more to do. */
+        break;
+      }
+      for (i = 0; i < len; i ++) {
+        if (write_all(serial_fd, buf + i, 1)) {
+          break;
+        }
+      }
+      if (i < len) {
+        perror("Error writing serial port");
+        break;
+      }
     }
-    if (len == 0) {
-      continue;
+
+    if (fds[1].revents & POLLIN) {
+      len = read(serial_fd, buf, SERIAL_BUF_SIZE);
+      if (len < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        perror("Error reading serial port");
+        break;
+      }
+      if (len > 0 && write_all(STDOUT_FILENO, buf, len)) {
+        break;
+      }
     }
 
-    buf[len] = '\0';
-    fputs(buf, stdout);
-    fflush(stdout);
+    if ((fds[0].revents | fds[1].revents) & (POLLERR | POLLHUP | POLLNVAL)) {
+      /* Device unplugged or terminal gone. */
+      break;
+    }
   }
 
   /* Cleaning up. */
-  serial_close(serial_fd);
+  fm_serial_close(serial_fd);
   sig_handler(0);
 
   return 0;
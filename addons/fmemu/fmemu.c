@@ -0,0 +1,629 @@
+#define _XOPEN_SOURCE 700 /* posix_openpt() and friends. */
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "stats.h"
+#include "alarm.h"
+#include "protocol.h"
+#include "config.h"
+#include "ui.h"
+
+/*
+ * Emulates the meter on a pseudo-terminal, for testing and load-testing host tools without hardware.
+ *
+ * The screen, the text and binary streams, the commands and the option tables are the firmware's own ui.c,
+ * the statistics and alarms its stats.c and alarm.c. Readings are synthetic (a nominal frequency with noise
+ * and drift, quantized like the real counter) or replayed from a file, at the gate rate or at any rate given
+ * with -r. Output goes through a buffer of the size of the device's, so a host that does not keep up loses
+ * readings the same way it would on the real thing: binary records show sequence gaps, lines are skipped.
+ */
+
+#define LINE_SIZE     256
+#define IDLE_MS       10    /* Polling for a host to open the port. */
+#define STATUS_NS     1000000000
+#define PRELIM_MS     100   /* First gate, as in freqmeter.c. */
+
+/* Device state, as in freqmeter.c. The setup itself is in ui.c. */
+static uint32_t freq            = 0;
+static uint16_t freq_mhz        = 0;
+static bool     freq_prelim     = false;
+static bool     led             = false;
+static uint16_t rec_seq         = 0;
+
+/* Saved setup, 'w' and 'r'. Lives as long as the emulator. */
+static struct config saved;
+static bool          saved_valid = false;
+
+/* Signal source. */
+static double   nominal_hz      = 8000000.0;
+static double   noise_hz        = 0.0;
+static double   drift_hz_s      = 0.0;
+static double  *replay          = NULL;
+static size_t   replay_len      = 0;
+static size_t   replay_pos      = 0;
+static double   phase           = 0.0; /* Fraction of a count carried over to the next gate. */
+
+/* Emulated endpoint buffer and the link to the host. */
+static int      master_fd       = -1;
+static char    *out_buf         = NULL;
+static size_t   out_size        = 1024; /* 64 binary records, like REC_RING on the device. */
+static size_t   out_len         = 0;
+static bool     connected       = false;
+
+static uint64_t readings        = 0;
+static uint64_t dropped         = 0;
+static uint64_t bytes_sent      = 0;
+static int64_t  start_ns        = 0;
+
+static volatile bool stop = false;
+
+static void sig_handler(int signo) {
+  stop = true;
+}
+
+static int64_t clock_ns(clockid_t id) {
+  struct timespec ts;
+
+  clock_gettime(id, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* alarm.c reports to the host through CDC serial state, which a pseudo-terminal cannot carry. */
+void usbcdc_set_serial_state(uint16_t state) {
+}
+
+/* Host side */
+
+static void out_flush(void) {
+  ssize_t ret;
+
+  while (out_len) {
+    ret = write(master_fd, out_buf, out_len);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      /* EAGAIN: host not reading. EIO: host just closed the port. */
+      return;
+    }
+    memmove(out_buf, out_buf + ret, out_len - ret);
+    out_len    -= ret;
+    bytes_sent += ret;
+  }
+}
+
+/* All or nothing, a full buffer drops the whole line or record. */
+static bool out_put(const void *data, size_t len) {
+  if (!connected) {
+    return true;
+  }
+  if (out_len + len > out_size) {
+    out_flush();
+    if (out_len + len > out_size) {
+      return false;
+    }
+  }
+
+  memcpy(out_buf + out_len, data, len);
+  out_len += len;
+  return true;
+}
+
+/* Hooks of ui.c */
+
+bool ui_write(const char *text, size_t len) {
+  return out_put(text, len);
+}
+
+void ui_apply(unsigned what) {
+  /* The source reads the setup as it goes, only what is under way has to go. */
+  if (what & UI_APPLY_GATE) {
+    phase = 0.0;
+  }
+  if ((what & UI_APPLY_OUTPUT) && (output == OUTPUT_BINARY)) {
+    /* Drop whatever text is still queued, the stream starts on a record boundary. */
+    out_len = 0;
+  }
+}
+
+bool config_load(struct config *cfg) {
+  if (saved_valid) {
+    *cfg = saved;
+  }
+  return saved_valid;
+}
+
+bool config_save(const struct config *cfg) {
+  saved       = *cfg;
+  saved_valid = true;
+  return true;
+}
+
+/* The reading of the last gate, as shown. */
+static void reading_get(struct ui_reading *r) {
+  r->hz     = freq;
+  r->mhz    = freq_mhz;
+  r->prelim = freq_prelim;
+  r->dot    = led;
+}
+
+/* Signal source */
+
+static double gauss(void) {
+  double u1 = (random() + 1.0) / (RAND_MAX + 2.0);
+  double u2 = (random() + 1.0) / (RAND_MAX + 2.0);
+
+  return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+/* One gate worth of counting, returns the reading in mHz. */
+static uint64_t source_next(double t_s, uint32_t gate) {
+  int      psc  = 1 << prescaler_current;
+  int      per  = (count_current == COUNT_BOTH) ? 2 : 1; /* Edges per period. */
+  double   f, ticks;
+  uint64_t count, half, mhz;
+
+  if (replay) {
+    f = replay[replay_pos ++];
+    if (replay_pos == replay_len) {
+      replay_pos = 0;
+    }
+    /* Recorded readings are already quantized. */
+    return (uint64_t)llround(f * 1000.0);
+  }
+
+  f = nominal_hz + drift_hz_s * t_s + noise_hz * gauss();
+  if (f < 0) {
+    f = 0;
+  }
+
+  if (estimator_current == EST_FIT) {
+    /* Roughly the count step over the square root of the number of samples. */
+    f  += gauss() * psc * (1000.0 / gate) / per / sqrt(FIT_HZ * gate / 1000.0);
+    mhz = (f > 0) ? (uint64_t)llround(f * 1000.0) : 0;
+
+    return ui_calibrate(mhz);
+  }
+
+  /* Edges seen by the counter during the gate, the fraction left over shifts into the next gate. */
+  ticks  = f * per * gate / 1000.0 / psc + phase;
+  count  = (uint64_t)ticks;
+  phase  = ticks - count;
+
+  count *= psc;
+  count *= 1000 / gate;
+  half   = count % per;
+  count /= per;
+
+  return ui_calibrate(count * 1000 + half * 500);
+}
+
+static int load_replay(const char *path) {
+  FILE  *f = fopen(path, "r");
+  char   line[LINE_SIZE];
+  char  *p;
+  size_t cap = 0;
+  int    col;
+  double v;
+
+  if (!f) {
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), f)) {
+    p = line;
+    /* CSV exported by freqlog: frequency is the fourth column. */
+    if (strchr(line, ',')) {
+      for (col = 0; (col < 3) && p; col ++) {
+        p = strchr(p, ',');
+        p = p ? p + 1 : NULL;
+      }
+      if (!p) {
+        continue;
+      }
+    }
+    if (!isdigit((unsigned char)*p) && (*p != ' ')) {
+      /* Header or comment. */
+      continue;
+    }
+    v = strtod(p, NULL);
+
+    if (replay_len == cap) {
+      cap = cap ? cap * 2 : 4096;
+      replay = realloc(replay, cap * sizeof(*replay));
+      if (!replay) {
+        fclose(f);
+        return -1;
+      }
+    }
+    replay[replay_len ++] = v;
+  }
+  fclose(f);
+
+  if (!replay_len) {
+    errno = ENODATA;
+    return -1;
+  }
+  return 0;
+}
+
+/* Gate */
+
+static void gate_close(int64_t now_ns, bool prelim) {
+  struct proto_record rec;
+  struct ui_reading   r;
+  uint64_t mhz = source_next((now_ns - start_ns) / 1e9, prelim ? PRELIM_MS : gates_ms[gate_current]);
+
+  readings ++;
+  led = !led;
+
+  r.hz     = mhz / 1000;
+  r.mhz    = mhz % 1000;
+  r.prelim = prelim;
+  r.dot    = led;
+
+  /* Alarms keep watching the live signal while holding, but not the coarse reading of a short gate. */
+  if (!prelim) {
+    alarm_check(r.hz);
+  }
+  if (!hold) {
+    freq        = r.hz;
+    freq_mhz    = r.mhz;
+    freq_prelim = prelim;
+  }
+  if (!hold && !prelim && r.hz) {
+    stats_update(r.hz);
+  } else {
+    stats_skip();
+  }
+
+  switch (output) {
+    case OUTPUT_BINARY: {
+      ui_record(&rec, &r, rec_seq ++, (now_ns - start_ns) / 1000);
+      if (!out_put(&rec, sizeof(rec))) {
+        dropped ++;
+      }
+      break;
+    }
+
+    case OUTPUT_TEXT: {
+      reading_get(&r);
+      if (!ui_line(&r)) {
+        dropped ++;
+      }
+      break;
+    }
+
+    case OUTPUT_SCREEN: {
+      reading_get(&r);
+      ui_render(&r);
+      break;
+    }
+  }
+}
+
+/* Reply to 't', as stream_time() in freqmeter.c. */
+static void time_probe(void) {
+  struct proto_record rec = {
+    .sync    = PROTO_SYNC,
+    .flags   = PROTO_FLAG_TIME,
+    .seq     = rec_seq,
+    .time_us = (clock_ns(CLOCK_MONOTONIC) - start_ns) / 1000,
+  };
+
+  rec.check = proto_check(&rec);
+  out_put(&rec, sizeof(rec));
+}
+
+/* Commands, as poll_command() in freqmeter.c. The self-test ('x') needs the hardware and is left out. */
+static void command(char cmd) {
+  struct ui_reading r;
+  uint32_t arg;
+
+  switch (ui_command(&cmd, &arg)) {
+    case UI_IDLE: {
+      return;
+    }
+
+    case UI_UPDATE: {
+      break;
+    }
+
+    case UI_OTHER: {
+      if ((cmd == 't') && (output == OUTPUT_BINARY)) {
+        time_probe();
+      }
+      return;
+    }
+  }
+
+  if (output == OUTPUT_SCREEN) {
+    reading_get(&r);
+    ui_render(&r);
+  }
+}
+
+static void host_read(void) {
+  char    buf[LINE_SIZE];
+  ssize_t ret, i;
+
+  ret = read(master_fd, buf, sizeof(buf));
+  for (i = 0; i < ret; i ++) {
+    command(buf[i]);
+  }
+}
+
+/* The pseudo-terminal hangs up while no host has it open. Opening it is the emulated connect event. */
+static void host_check(short revents) {
+  struct ui_reading r;
+  bool now = !(revents & POLLHUP);
+
+  if (now && !connected) {
+    connected = true;
+    out_len   = 0;
+    if (output == OUTPUT_SCREEN) {
+      reading_get(&r);
+      ui_redraw();
+      ui_render(&r);
+    }
+  } else if (!now && connected) {
+    connected = false;
+    out_len   = 0;
+  }
+}
+
+static int pty_open(const char *link_path) {
+  struct termios tio;
+  int slave;
+
+  master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if ((master_fd < 0) || grantpt(master_fd) || unlockpt(master_fd)) {
+    return -1;
+  }
+
+  /* Raw like a CDC ACM port, and hung up until a host opens it. */
+  slave = open(ptsname(master_fd), O_RDWR | O_NOCTTY);
+  if (slave < 0) {
+    return -1;
+  }
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+  close(slave);
+
+  if (link_path) {
+    unlink(link_path);
+    if (symlink(ptsname(master_fd), link_path)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void print_status(bool last) {
+  fprintf(stderr, "\r%" PRIu64 " readings, %" PRIu64 " dropped, %" PRIu64 " bytes sent%s",
+          readings, dropped, bytes_sent, last ? "\n" : "");
+}
+
+static void print_help(const char *self) {
+  fprintf(stderr, "\
+Usage: %s [-l link] [-r rate] [-b bytes] [-F hz] [-n hz] [-D hz] [-i file]\n\
+\n\
+\t-b\t Set the emulated device buffer in bytes.\n\
+\t  \t Default: 1024 (64 binary records)\n\
+\t-D\t Set the frequency drift in Hz per second.\n\
+\t-F\t Set the nominal frequency in Hz.\n\
+\t  \t Default: 8000000\n\
+\t-h\t Print this help.\n\
+\t-i\t Replay readings from a file instead, one value in Hz per line or a CSV exported by freqlog.\n\
+\t-l\t Also make the pseudo-terminal available under this name.\n\
+\t-n\t Set the RMS noise of the frequency in Hz.\n\
+\t-r\t Set the readings per second, regardless of the gate time selected on the emulated device.\n\
+\t  \t Default: follow the gate time\n\
+\n\
+Example: %s -l /tmp/ttyFM0 -r 100000 -n 5\n\
+\n", self, self);
+}
+
+static void handle_bad_opts(void) {
+  if (strchr("bDFilnr", optopt)) {
+    fprintf(stderr, "ERROR: option -%c requires an argument.\n\n", optopt);
+  } else if (isprint(optopt)) {
+    fprintf(stderr, "ERROR: unknown option `-%c'.\n\n", optopt);
+  } else {
+    fprintf(stderr, "ERROR: unknown option character `\\x%x'.\n\n", optopt);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  char    *link_path = NULL;
+  double   rate      = 0;
+  int64_t  period_ns = 0, next_ns = 0, now_ns, last_status = 0;
+  struct itimerspec its = {{0}};
+  struct pollfd fds[2];
+  uint64_t expirations;
+  int      timer_fd;
+  int      gate = -1;
+  bool     prelim = false;
+
+  int c;
+  opterr = 0;
+  while ((c = getopt(argc, argv, "b:D:F:hi:l:n:r:")) != -1) {
+    switch (c) {
+      case 'b': {
+        out_size = strtoul(optarg, NULL, 10);
+        break;
+      }
+
+      case 'D': {
+        drift_hz_s = strtod(optarg, NULL);
+        break;
+      }
+
+      case 'F': {
+        nominal_hz = strtod(optarg, NULL);
+        break;
+      }
+
+      case 'h': {
+        print_help(argv[0]);
+        return 0;
+      }
+
+      case 'i': {
+        if (load_replay(optarg)) {
+          perror("ERROR: cannot load replay file");
+          return errno;
+        }
+        break;
+      }
+
+      case 'l': {
+        link_path = optarg;
+        break;
+      }
+
+      case 'n': {
+        noise_hz = strtod(optarg, NULL);
+        break;
+      }
+
+      case 'r': {
+        rate = strtod(optarg, NULL);
+        break;
+      }
+
+      case '?': {
+        handle_bad_opts();
+        print_help(argv[0]);
+        return -EINVAL;
+      }
+
+      default: {
+        fprintf(stderr, "BUG: switch fall-through on `%c'!\n", c);
+        abort();
+      }
+    }
+  }
+
+  if ((out_size < sizeof(struct proto_record)) || (rate < 0)) {
+    print_help(argv[0]);
+    return -EINVAL;
+  }
+  out_buf = malloc(out_size);
+  if (!out_buf) {
+    perror("ERROR: cannot allocate buffer");
+    return errno;
+  }
+
+  if (pty_open(link_path)) {
+    perror("ERROR: cannot create pseudo-terminal");
+    return errno;
+  }
+  printf("%s\n", link_path ? link_path : ptsname(master_fd));
+  fflush(stdout);
+
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd < 0) {
+    perror("ERROR: timerfd");
+    return errno;
+  }
+
+  struct sigaction sa = {.sa_handler = sig_handler};
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  srandom(time(NULL));
+  start_ns = clock_ns(CLOCK_MONOTONIC);
+  stats_reset();
+
+  fds[0].fd     = master_fd;
+  fds[1].fd     = timer_fd;
+  fds[1].events = POLLIN;
+
+  while (!stop) {
+    /* Gate changed (or first round): re-arm the timer. */
+    if (gate != gate_current) {
+      /* Like the device, start with a short gate so that a reading is ready soon. */
+      prelim    = (gate < 0) && (rate <= 0) && (gates_ms[gate_current] > PRELIM_MS);
+      gate      = gate_current;
+      period_ns = (rate > 0) ? (int64_t)(1e9 / rate) : (int64_t)gates_ms[gate] * 1000000;
+      if (period_ns < 1) {
+        period_ns = 1;
+      }
+      its.it_interval.tv_sec  = period_ns / 1000000000;
+      its.it_interval.tv_nsec = period_ns % 1000000000;
+      its.it_value            = its.it_interval;
+      if (prelim) {
+        its.it_value.tv_sec  = 0;
+        its.it_value.tv_nsec = (int64_t)PRELIM_MS * 1000000;
+      }
+      timerfd_settime(timer_fd, 0, &its, NULL);
+      next_ns = clock_ns(CLOCK_MONOTONIC) + (prelim ? (int64_t)PRELIM_MS * 1000000 : period_ns);
+    }
+
+    /* A hung up pseudo-terminal is always ready, only look at it now and then until a host shows up. */
+    fds[0].fd     = connected ? master_fd : -1;
+    fds[0].events = POLLIN | (out_len ? POLLOUT : 0);
+    if (poll(fds, 2, connected ? -1 : IDLE_MS) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("ERROR: poll");
+      break;
+    }
+
+    if (!connected) {
+      fds[0].fd = master_fd;
+      poll(fds, 1, 0);
+    }
+    host_check(fds[0].revents);
+    if (fds[0].revents & POLLIN) {
+      host_read();
+    }
+
+    if ((fds[1].revents & POLLIN) && (read(timer_fd, &expirations, sizeof(expirations)) > 0)) {
+      /* At high rates one wakeup stands for many gates, spread their timestamps evenly. */
+      while (expirations --) {
+        gate_close(next_ns, prelim);
+        next_ns += period_ns;
+        prelim   = false;
+      }
+    }
+
+    out_flush();
+
+    now_ns = clock_ns(CLOCK_MONOTONIC);
+    if (now_ns - last_status > STATUS_NS) {
+      print_status(false);
+      last_status = now_ns;
+    }
+  }
+
+  print_status(true);
+  if (link_path) {
+    unlink(link_path);
+  }
+  close(master_fd);
+
+  return 0;
+}
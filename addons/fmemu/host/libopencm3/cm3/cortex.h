@@ -0,0 +1,7 @@
+#ifndef __FMEMU_CORTEX_H__
+#define __FMEMU_CORTEX_H__
+
+/* Host stand-in so that the firmware's stats.c builds for the emulator, which is single-threaded. */
+#define CM_ATOMIC_BLOCK() for (int cm_atomic_once = 1; cm_atomic_once; cm_atomic_once = 0)
+
+#endif /* __FMEMU_CORTEX_H__ */
@@ -0,0 +1,370 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "libfreqmeter.h"
+
+/*
+ * End-to-end latency from gate close on the device to delivery on the host.
+ *
+ * Every binary record carries the device clock at gate close. The offset between that clock and the host's
+ * CLOCK_MONOTONIC is estimated with time probes ('t'), as in NTP: a probe sent at t1 and answered at t2
+ * puts the device clock at the midpoint, within half the round trip. Only the probes with the shortest
+ * round trips are trusted; one from the start and one from the end of the run also give the drift between
+ * the two crystals. The latency of a reading is its arrival time minus its gate close mapped to host time.
+ *
+ * Arrival is when read() returned, so this covers the gate, the device queue, USB scheduling and the tty
+ * layer, but not the consumer's own processing.
+ */
+
+#define PROBE_NS     100000000 /* Between time probes. */
+#define MAX_PROBES   65536
+#define CHUNK        65536     /* Readings, memory grows by this much. */
+
+struct probe {
+  int64_t sent_ns;
+  int64_t rtt_ns;
+  int64_t host_ns;   /* Midpoint.      */
+  int64_t device_ns; /* Unwrapped.     */
+};
+
+struct bench {
+  /* Device clock unwrapping. */
+  bool     have_us;
+  uint32_t last_us;
+  int64_t  device_ns;
+
+  /* Probe in flight, 0 if none. */
+  int64_t  probe_sent_ns;
+  struct probe probes[MAX_PROBES];
+  size_t   n_probes;
+
+  /* Per reading: gate close on the device clock, arrival on the host clock. */
+  int64_t *device;
+  int64_t *arrival;
+  size_t   n;
+  size_t   cap;
+  uint64_t lost;
+  bool     oom;
+};
+
+static volatile bool stop = false;
+static volatile bool load_stop = false;
+
+static void sig_handler(int signo) {
+  stop = true;
+}
+
+static int64_t clock_ns(clockid_t id) {
+  struct timespec ts;
+
+  clock_gettime(id, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Busy thread for the loaded case. */
+static void *load_thread(void *arg) {
+  volatile uint64_t x = 0;
+
+  while (!load_stop) {
+    x ++;
+  }
+
+  return NULL;
+}
+
+/* Signed steps, so that a probe stamped just after the next gate close does not look like a wrap. */
+static int64_t unwrap(struct bench *b, uint32_t us) {
+  if (b->have_us) {
+    b->device_ns += (int64_t)(int32_t)(us - b->last_us) * 1000;
+  } else {
+    b->device_ns = (int64_t)us * 1000;
+    b->have_us   = true;
+  }
+  b->last_us = us;
+
+  return b->device_ns;
+}
+
+static void on_record(const struct fm_reading *r, void *user) {
+  struct bench *b = user;
+  int64_t dev_ns  = unwrap(b, r->device_us);
+  struct probe *p;
+
+  if (r->flags & PROTO_FLAG_TIME) {
+    if (b->probe_sent_ns && (b->n_probes < MAX_PROBES)) {
+      p = &b->probes[b->n_probes ++];
+      p->sent_ns   = b->probe_sent_ns;
+      p->rtt_ns    = r->mono_ns - b->probe_sent_ns;
+      p->host_ns   = b->probe_sent_ns + p->rtt_ns / 2;
+      p->device_ns = dev_ns;
+    }
+    b->probe_sent_ns = 0;
+    return;
+  }
+
+  b->lost += r->lost;
+  if (b->n == b->cap) {
+    int64_t *d = realloc(b->device, (b->cap + CHUNK) * sizeof(int64_t));
+    int64_t *a = d ? realloc(b->arrival, (b->cap + CHUNK) * sizeof(int64_t)) : NULL;
+
+    if (d) {
+      b->device = d;
+    }
+    if (!a) {
+      b->oom = true;
+      return;
+    }
+    b->arrival = a;
+    b->cap    += CHUNK;
+  }
+  b->device[b->n]  = dev_ns;
+  b->arrival[b->n] = r->mono_ns;
+  b->n ++;
+}
+
+/* The probe with the shortest round trip among probes[from, to). */
+static const struct probe *best_probe(const struct bench *b, size_t from, size_t to) {
+  const struct probe *best = NULL;
+  size_t i;
+
+  for (i = from; i < to; i ++) {
+    if (!best || (b->probes[i].rtt_ns < best->rtt_ns)) {
+      best = &b->probes[i];
+    }
+  }
+
+  return best;
+}
+
+static int cmp_i64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void report(struct bench *b, const char *csv) {
+  const struct probe *p0, *p1;
+  double   drift = 0;
+  int64_t *lat   = b->arrival; /* Reused in place. */
+  int64_t  sum   = 0;
+  size_t   i, q;
+  FILE    *f     = NULL;
+  static const double pct[] = {50, 90, 99, 99.9};
+
+  if (b->n_probes == 0) {
+    fprintf(stderr, "ERROR: no replies to time probes, is the firmware recent enough?\n");
+    return;
+  }
+  if (b->n == 0) {
+    fprintf(stderr, "ERROR: no readings.\n");
+    return;
+  }
+
+  /* Best probe of the first and of the last quarter, or just the best one for short runs. */
+  q  = b->n_probes / 4;
+  p0 = best_probe(b, 0, q ? q : b->n_probes);
+  p1 = q ? best_probe(b, b->n_probes - q, b->n_probes) : p0;
+  if (p1->device_ns != p0->device_ns) {
+    drift = (double)((p1->host_ns - p0->host_ns) - (p1->device_ns - p0->device_ns)) / (p1->device_ns - p0->device_ns);
+  }
+
+  if (csv) {
+    f = fopen(csv, "w");
+    if (!f) {
+      perror("ERROR: cannot write CSV");
+    } else {
+      fprintf(f, "device_s,latency_us\n");
+    }
+  }
+
+  for (i = 0; i < b->n; i ++) {
+    int64_t dt   = b->device[i] - p0->device_ns;
+    int64_t host = p0->host_ns + dt + (int64_t)(drift * dt);
+
+    lat[i] = b->arrival[i] - host;
+    sum   += lat[i];
+    if (f) {
+      fprintf(f, "%.6f,%.1f\n", b->device[i] / 1e9, lat[i] / 1e3);
+    }
+  }
+  if (f) {
+    fclose(f);
+  }
+  qsort(lat, b->n, sizeof(int64_t), cmp_i64);
+
+  printf("Readings:     %zu (%" PRIu64 " lost on device)\n", b->n, b->lost);
+  printf("Probes:       %zu, best round trip %.1f us, offset uncertainty +/- %.1f us\n",
+         b->n_probes, p0->rtt_ns / 1e3, ((p0->rtt_ns > p1->rtt_ns) ? p0->rtt_ns : p1->rtt_ns) / 2e3);
+  printf("Clock drift:  %+.3f ppm (device relative to host)\n", -drift * 1e6);
+  printf("Latency (us): min %.1f, mean %.1f", lat[0] / 1e3, (double)sum / b->n / 1e3);
+  for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i ++) {
+    printf(", p%g %.1f", pct[i], lat[(size_t)((b->n - 1) * pct[i] / 100)] / 1e3);
+  }
+  printf(", max %.1f\n", lat[b->n - 1] / 1e3);
+}
+
+static void print_help(const char *self) {
+  fprintf(stderr, "\
+Usage: %s [-d serial] [-t seconds] [-l threads] [-o csv]\n\
+\n\
+\t-d\t Set the USB CDC device\n\
+\t  \t e.g. /dev/ttyACM0 \t Default: /dev/ttyACM0\n\
+\t-h\t Print this help.\n\
+\t-l\t Run this many busy threads during the measurement, for the loaded case.\n\
+\t  \t Default: 0\n\
+\t-o\t Also write the latency of every reading as CSV.\n\
+\t-t\t Set the duration in seconds.\n\
+\t  \t Default: 10\n\
+\n\
+Example: %s -d /dev/ttyACM1 -t 60 -l 4\n\
+\n", self, self);
+}
+
+static void handle_bad_opts(void) {
+  if ((optopt == 'd') || (optopt == 'l') || (optopt == 'o') || (optopt == 't')) {
+    fprintf(stderr, "ERROR: option -%c requires an argument.\n\n", optopt);
+  } else if (isprint(optopt)) {
+    fprintf(stderr, "ERROR: unknown option `-%c'.\n\n", optopt);
+  } else {
+    fprintf(stderr, "ERROR: unknown option character `\\x%x'.\n\n", optopt);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  static struct bench      b;
+  static struct fm_decoder dec;
+  char     *device   = "/dev/ttyACM0";
+  char     *csv      = NULL;
+  double    duration = 10;
+  int       threads  = 0;
+  pthread_t *load    = NULL;
+  int64_t   start_ns, now_ns, next_probe = 0;
+  struct pollfd pfd;
+  int       fd, i;
+
+  int c;
+  opterr = 0;
+  while ((c = getopt(argc, argv, "d:hl:o:t:")) != -1) {
+    switch (c) {
+      case 'd': {
+        device = optarg;
+        break;
+      }
+
+      case 'h': {
+        print_help(argv[0]);
+        return 0;
+      }
+
+      case 'l': {
+        threads = atoi(optarg);
+        break;
+      }
+
+      case 'o': {
+        csv = optarg;
+        break;
+      }
+
+      case 't': {
+        duration = strtod(optarg, NULL);
+        break;
+      }
+
+      case '?': {
+        handle_bad_opts();
+        print_help(argv[0]);
+        return -EINVAL;
+      }
+
+      default: {
+        fprintf(stderr, "BUG: switch fall-through on `%c'!\n", c);
+        abort();
+      }
+    }
+  }
+
+  if ((duration <= 0) || (threads < 0)) {
+    print_help(argv[0]);
+    return -EINVAL;
+  }
+
+  fd = fm_serial_open(device);
+  if (fd < 0) {
+    perror("ERROR: cannot open serial port");
+    return errno;
+  }
+  if (fm_select_stream(fd, &dec, FM_STREAM_BINARY)) {
+    perror("ERROR: cannot write to serial port");
+    return errno;
+  }
+
+  struct sigaction sa = {.sa_handler = sig_handler};
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  if (threads) {
+    load = calloc(threads, sizeof(pthread_t));
+    for (i = 0; load && (i < threads); i ++) {
+      pthread_create(&load[i], NULL, load_thread, NULL);
+    }
+  }
+
+  pfd.fd     = fd;
+  pfd.events = POLLIN;
+  start_ns   = clock_ns(CLOCK_MONOTONIC);
+
+  while (!stop && !b.oom) {
+    now_ns = clock_ns(CLOCK_MONOTONIC);
+    if (now_ns - start_ns >= duration * 1e9) {
+      break;
+    }
+
+    /* One probe in flight at a time; a lost one is given up on at the next slot. */
+    if (now_ns >= next_probe) {
+      b.probe_sent_ns = clock_ns(CLOCK_MONOTONIC);
+      if (fm_send(fd, "t")) {
+        perror("ERROR: cannot write to serial port");
+        break;
+      }
+      next_probe = now_ns + PROBE_NS;
+    }
+
+    if (poll(&pfd, 1, (next_probe - now_ns) / 1000000 + 1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("ERROR: poll");
+      break;
+    }
+    if ((pfd.revents & POLLIN) && (fm_decoder_read(&dec, fd, on_record, &b) <= 0)) {
+      perror("ERROR: cannot read from serial port");
+      break;
+    }
+  }
+
+  load_stop = true;
+  for (i = 0; load && (i < threads); i ++) {
+    pthread_join(load[i], NULL);
+  }
+  fm_serial_close(fd);
+
+  if (b.oom) {
+    fprintf(stderr, "ERROR: out of memory, reporting what was collected.\n");
+  }
+  report(&b, csv);
+
+  return 0;
+}
@@ -0,0 +1,661 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "libfreqmeter.h"
+
+/*
+ * Power spectrum of the fractional frequency deviation y = (f - f0) / f0, Welch's method: Hann-windowed
+ * segments of N readings, overlapping by half, averaged.
+ *
+ * Readings are taken from the binary stream, so none are skipped and the sample rate is steady. Readings
+ * lost on the device, or taken without a signal, are filled in with the previous value to keep the time base.
+ * The short preliminary gate after power-up is left out.
+ *
+ * Memory is fixed by N. The FFT is an iterative radix-2 on split real / imaginary arrays with contiguous
+ * per-stage twiddles, so that the butterfly loops vectorize. The input is real, so two consecutive segments
+ * share one complex transform, one as the real part and one as the imaginary part.
+ */
+
+#define LINE_SIZE   256
+#define SPURS_MAX   10
+#define SPUR_DB     10.0 /* Above the median to count as a spur. */
+
+struct spectrum {
+  int     n;           /* Segment length, power of 2. */
+  int     hop;         /* Readings between segment starts. */
+  double  fs;          /* Sample rate in Hz, 0 until known. */
+  double  f0;          /* Nominal frequency in Hz, 0 until known. */
+
+  /* Input. */
+  double *seg;         /* Ring of the last n readings in Hz.    */
+  int     head;        /* Oldest reading once seg is full.      */
+  int     fill;        /* Readings in seg.                      */
+  int     since;       /* Readings since the last segment.      */
+  double  last_hz;
+  bool    pending;     /* A windowed segment waits in re[].     */
+
+  /* Transform, split complex. */
+  double *re;
+  double *im;
+  double *tw_re;       /* Twiddles of the stage with half size h at [h, 2h). */
+  double *tw_im;
+  int    *rev;         /* Bit reversal permutation. */
+  double *win;
+  double  win_power;   /* Sum of squared window samples. */
+
+  /* Averaged one-sided PSD of y, bins 0 .. n / 2. */
+  double *psd;
+  double *scratch;
+  uint64_t segments;
+  int      average;    /* Exponential averaging over this many segments, 0 for all. */
+};
+
+static volatile bool stop = false;
+
+static void sig_handler(int signo) {
+  stop = true;
+}
+
+static int64_t clock_ns(clockid_t id) {
+  struct timespec ts;
+
+  clock_gettime(id, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int spectrum_init(struct spectrum *s, int n, int average) {
+  int i, h, bits;
+
+  memset(s, 0, sizeof(*s));
+  s->n       = n;
+  s->hop     = n / 2;
+  s->since   = s->hop - 1; /* First segment as soon as seg is full. */
+  s->average = average;
+
+  s->seg     = calloc(n, sizeof(double));
+  s->re      = calloc(n, sizeof(double));
+  s->im      = calloc(n, sizeof(double));
+  s->tw_re   = calloc(n, sizeof(double));
+  s->tw_im   = calloc(n, sizeof(double));
+  s->win     = calloc(n, sizeof(double));
+  s->psd     = calloc(n / 2 + 1, sizeof(double));
+  s->scratch = calloc(n / 2 + 1, sizeof(double));
+  s->rev     = calloc(n, sizeof(int));
+  if (!s->seg || !s->re || !s->im || !s->tw_re || !s->tw_im || !s->win || !s->psd || !s->scratch || !s->rev) {
+    return -1;
+  }
+
+  for (bits = 0; (1 << bits) < n; bits ++);
+  for (i = 0; i < n; i ++) {
+    int r = 0, b;
+
+    for (b = 0; b < bits; b ++) {
+      r |= ((i >> b) & 1) << (bits - 1 - b);
+    }
+    s->rev[i] = r;
+  }
+
+  for (h = 1; h < n; h <<= 1) {
+    for (i = 0; i < h; i ++) {
+      s->tw_re[h + i] =  cos(M_PI * i / h);
+      s->tw_im[h + i] = -sin(M_PI * i / h);
+    }
+  }
+
+  for (i = 0; i < n; i ++) {
+    s->win[i]      = 0.5 - 0.5 * cos(2.0 * M_PI * i / n);
+    s->win_power  += s->win[i] * s->win[i];
+  }
+
+  return 0;
+}
+
+static void fft(struct spectrum *s) {
+  double *restrict re = s->re;
+  double *restrict im = s->im;
+  int n = s->n;
+  int i, j, k, h;
+
+  for (i = 0; i < n; i ++) {
+    j = s->rev[i];
+    if (i < j) {
+      double t;
+      t = re[i]; re[i] = re[j]; re[j] = t;
+      t = im[i]; im[i] = im[j]; im[j] = t;
+    }
+  }
+
+  for (h = 1; h < n; h <<= 1) {
+    const double *restrict wr = s->tw_re + h;
+    const double *restrict wi = s->tw_im + h;
+
+    for (k = 0; k < n; k += 2 * h) {
+      double *restrict ar = re + k;
+      double *restrict ai = im + k;
+      double *restrict br = re + k + h;
+      double *restrict bi = im + k + h;
+
+      for (j = 0; j < h; j ++) {
+        double tr = br[j] * wr[j] - bi[j] * wi[j];
+        double ti = br[j] * wi[j] + bi[j] * wr[j];
+
+        br[j] = ar[j] - tr;
+        bi[j] = ai[j] - ti;
+        ar[j] = ar[j] + tr;
+        ai[j] = ai[j] + ti;
+      }
+    }
+  }
+}
+
+static void psd_add(struct spectrum *s, const double *p) {
+  int    i, bins = s->n / 2 + 1;
+  double a;
+
+  s->segments ++;
+  a = 1.0 / s->segments;
+  if (s->average && (s->segments > s->average)) {
+    a = 1.0 / s->average;
+  }
+
+  for (i = 0; i < bins; i ++) {
+    s->psd[i] += a * (p[i] - s->psd[i]);
+  }
+}
+
+/*
+ * Z = FFT(x1 + j x2) gives X1[k] = (Z[k] + Z*[n - k]) / 2 and X2[k] = (Z[k] - Z*[n - k]) / 2j, so
+ * |X1|^2 and |X2|^2 follow from the sums and differences of Z[k] and Z[n - k].
+ */
+static void transform(struct spectrum *s, bool two) {
+  double *p = s->scratch;
+  double  scale;
+  int     n = s->n, k;
+
+  fft(s);
+
+  /* One-sided density of y = x / f0, per Hz. */
+  scale = 1.0 / (s->f0 * s->f0 * s->fs * s->win_power);
+
+  for (k = 0; k <= n / 2; k ++) {
+    int    m  = (n - k) & (n - 1);
+    double sr = s->re[k] + s->re[m], si = s->im[k] - s->im[m];
+    double one = ((k == 0) || (k == n / 2)) ? 1.0 : 2.0;
+
+    p[k] = one * scale * 0.25 * (sr * sr + si * si);
+  }
+  psd_add(s, p);
+
+  if (two) {
+    for (k = 0; k <= n / 2; k ++) {
+      int    m  = (n - k) & (n - 1);
+      double dr = s->re[k] - s->re[m], di = s->im[k] + s->im[m];
+      double one = ((k == 0) || (k == n / 2)) ? 1.0 : 2.0;
+
+      p[k] = one * scale * 0.25 * (dr * dr + di * di);
+    }
+    psd_add(s, p);
+  }
+}
+
+/* Windows the current segment with its mean removed, into re[] first and im[] second. */
+static void segment_take(struct spectrum *s) {
+  double *dst = s->pending ? s->im : s->re;
+  double  mean = 0;
+  int     i, tail = s->n - s->head;
+
+  for (i = 0; i < s->n; i ++) {
+    mean += s->seg[i];
+  }
+  mean /= s->n;
+
+  /* Oldest first: seg[head .. n) then seg[0 .. head). */
+  for (i = 0; i < tail; i ++) {
+    dst[i] = (s->seg[s->head + i] - mean) * s->win[i];
+  }
+  for (i = tail; i < s->n; i ++) {
+    dst[i] = (s->seg[i - tail] - mean) * s->win[i];
+  }
+
+  if (s->pending) {
+    transform(s, true);
+    s->pending = false;
+  } else {
+    s->pending = true;
+  }
+}
+
+static void spectrum_push(struct spectrum *s, double hz) {
+  s->seg[s->head] = hz;
+  s->head = (s->head + 1) & (s->n - 1);
+  if (s->fill < s->n) {
+    s->fill ++;
+  }
+  s->last_hz = hz;
+
+  if (s->fill < s->n) {
+    return;
+  }
+  if (s->f0 == 0) {
+    /* Nominal frequency from the first full segment unless given. */
+    int i;
+
+    for (i = 0; i < s->n; i ++) {
+      s->f0 += s->seg[i];
+    }
+    s->f0 /= s->n;
+    if (s->f0 == 0) {
+      s->f0 = 1;
+    }
+  }
+
+  if (++ s->since >= s->hop) {
+    s->since = 0;
+    segment_take(s);
+  }
+}
+
+/* Once the stream ends, the unpaired segment is transformed alone. */
+static void spectrum_finish(struct spectrum *s) {
+  if (s->pending) {
+    memset(s->im, 0, s->n * sizeof(double));
+    transform(s, false);
+    s->pending = false;
+  }
+}
+
+/* Output */
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static double db(double x) {
+  return (x > 0) ? 10.0 * log10(x) : -HUGE_VAL;
+}
+
+/* Single-sideband phase noise of the signal, L(f) = S_phi(f) / 2 = S_y(f) * f0^2 / (2 f^2). */
+static double ssb_dbc(const struct spectrum *s, int k) {
+  double f = k * s->fs / s->n;
+
+  return db(s->psd[k] * s->f0 * s->f0 / (2.0 * f * f));
+}
+
+static void show(const struct spectrum *s, bool screen) {
+  int    bins = s->n / 2 + 1;
+  int    spur[SPURS_MAX];
+  int    n_spurs = 0, i, k;
+  double floor_db;
+
+  /* Median over bins 1 .. n / 2, in scratch to keep psd[] untouched. */
+  memcpy(s->scratch, s->psd + 1, (bins - 1) * sizeof(double));
+  qsort(s->scratch, bins - 1, sizeof(double), cmp_double);
+  floor_db = db(s->scratch[(bins - 1) / 2]);
+
+  /* Local maxima standing out of the floor, strongest first. */
+  for (k = 2; k < bins - 1; k ++) {
+    if ((s->psd[k] < s->psd[k - 1]) || (s->psd[k] < s->psd[k + 1]) || (db(s->psd[k]) - floor_db < SPUR_DB)) {
+      continue;
+    }
+    for (i = n_spurs; (i > 0) && (s->psd[spur[i - 1]] < s->psd[k]); i --) {
+      if (i < SPURS_MAX) {
+        spur[i] = spur[i - 1];
+      }
+    }
+    if (i < SPURS_MAX) {
+      spur[i] = k;
+      if (n_spurs < SPURS_MAX) {
+        n_spurs ++;
+      }
+    }
+  }
+
+  if (screen) {
+    printf("\033[H\033[2J");
+  }
+  printf("f0 %.3f Hz, fs %.3f Hz, N %d, RBW %.4f Hz, %" PRIu64 " segments\n",
+         s->f0, s->fs, s->n, 1.5 * s->fs / s->n, s->segments);
+  printf("Floor (median): %.1f dB/Hz S_y\n\n", floor_db);
+  printf("%14s %14s %16s %12s\n", "Spur (Hz)", "S_y (dB/Hz)", "L(f) (dBc/Hz)", "Above floor");
+  for (i = 0; i < n_spurs; i ++) {
+    k = spur[i];
+    printf("%14.4f %14.1f %16.1f %12.1f\n",
+           k * s->fs / s->n, db(s->psd[k]), ssb_dbc(s, k), db(s->psd[k]) - floor_db);
+  }
+  if (!screen) {
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+/* Full spectrum as CSV, replaced atomically so that a plotting loop never sees half a file. */
+static int write_csv(const struct spectrum *s, const char *path) {
+  char  tmp[FM_PATH_MAX + 8];
+  FILE *f;
+  int   k;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  f = fopen(tmp, "w");
+  if (!f) {
+    return -1;
+  }
+
+  fprintf(f, "frequency_hz,s_y_db_hz,l_dbc_hz\n");
+  for (k = 1; k <= s->n / 2; k ++) {
+    fprintf(f, "%.6f,%.2f,%.2f\n", k * s->fs / s->n, db(s->psd[k]), ssb_dbc(s, k));
+  }
+  if (fclose(f)) {
+    return -1;
+  }
+
+  return rename(tmp, path);
+}
+
+/* Input */
+
+struct input {
+  struct spectrum *s;
+  double           rate;      /* Given with -r, else estimated. */
+  uint64_t         readings;
+  uint64_t         filled;    /* Lost on the device and filled in. */
+  unsigned         los;       /* Without signal since the last reading, filled in with the next one. */
+  bool             have_us;
+  uint32_t         first_us;
+  uint32_t         last_us;
+  double           span_us;   /* Device time covered, wrap-safe. */
+  uint64_t         span_n;
+};
+
+static void input_reading(struct input *in, double hz, bool has_us, uint32_t device_us, unsigned lost) {
+  struct spectrum *s = in->s;
+
+  if (has_us) {
+    if (in->have_us) {
+      in->span_us += (uint32_t)(device_us - in->last_us);
+      in->span_n  += 1 + lost;
+    }
+    in->have_us = true;
+    in->last_us = device_us;
+  }
+
+  if (s->fs == 0) {
+    if (in->rate > 0) {
+      s->fs = in->rate;
+    } else if (in->span_n >= 16) {
+      s->fs = 1e6 * in->span_n / in->span_us;
+    } else {
+      in->readings ++;
+      return;
+    }
+  }
+
+  while (in->readings && lost --) {
+    spectrum_push(s, s->last_hz);
+    in->filled ++;
+  }
+  spectrum_push(s, hz);
+  in->readings ++;
+}
+
+/* HOLD only concerns the screen, hz is still the live reading. */
+static void input_record(struct input *in, double hz, uint32_t device_us, unsigned lost, unsigned flags) {
+  if (flags & (PROTO_FLAG_PRELIM | PROTO_FLAG_TIME)) {
+    return;
+  }
+  if (flags & PROTO_FLAG_LOS) {
+    /* 0Hz would put a step of the whole carrier into the segment. */
+    in->los += 1 + lost;
+    return;
+  }
+
+  input_reading(in, hz, true, device_us, lost + in->los);
+  in->los = 0;
+}
+
+static void device_reading(const struct fm_reading *r, void *user) {
+  input_record(user, r->mhz / 1000.0, r->device_us, r->lost, r->flags);
+}
+
+static int64_t next_show = 0;
+static int64_t show_ns   = 1000000000;
+
+static void maybe_show(struct spectrum *s, const char *csv, bool screen) {
+  int64_t now = clock_ns(CLOCK_MONOTONIC);
+
+  if ((now < next_show) || !s->segments) {
+    return;
+  }
+  next_show = now + show_ns;
+
+  show(s, screen);
+  if (csv && write_csv(s, csv)) {
+    perror("ERROR: cannot write spectrum");
+  }
+}
+
+static int run_device(struct input *in, const char *device, const char *csv) {
+  static struct fm_decoder dec;
+  int fd;
+
+  fd = fm_serial_open(device);
+  if (fd < 0) {
+    perror("ERROR: cannot open serial port");
+    return errno;
+  }
+  if (fm_select_stream(fd, &dec, FM_STREAM_BINARY)) {
+    perror("ERROR: cannot write to serial port");
+    return errno;
+  }
+
+  while (!stop) {
+    if (fm_decoder_read(&dec, fd, device_reading, in) <= 0) {
+      if (!stop) {
+        perror("ERROR: cannot read from serial port");
+      }
+      break;
+    }
+    maybe_show(in->s, csv, true);
+  }
+
+  fm_serial_close(fd);
+  return 0;
+}
+
+/* One value in Hz per line, or the CSV exported by freqlog (device time in the third column, frequency in the fourth). */
+static int run_file(struct input *in, const char *path, const char *csv) {
+  FILE    *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  char     line[LINE_SIZE];
+  char    *p, *q;
+  double   hz;
+  uint32_t us;
+  unsigned lost, flags;
+
+  if (!f) {
+    perror("ERROR: cannot open input");
+    return errno;
+  }
+
+  while (!stop && fgets(line, sizeof(line), f)) {
+    if (!strchr(line, ',')) {
+      if (!isdigit((unsigned char)line[0])) {
+        continue;
+      }
+      input_reading(in, strtod(line, NULL), false, 0, 0);
+      continue;
+    }
+
+    /* realtime,monotonic,device_us,frequency_hz,flags,lost */
+    p = strchr(line, ',');
+    p = p ? strchr(p + 1, ',') : NULL;
+    if (!p || !isdigit((unsigned char)p[1])) {
+      continue;
+    }
+    us    = strtoul(p + 1, &q, 10);
+    hz    = strtod(q + 1, &q);
+    flags = strtoul(q + 1, &q, 0); /* Exported in hex. */
+    lost  = (*q == ',') ? strtoul(q + 1, NULL, 10) : 0;
+    input_record(in, hz, us, lost, flags);
+  }
+
+  if (f != stdin) {
+    fclose(f);
+  }
+  return 0;
+}
+
+static void print_help(const char *self) {
+  fprintf(stderr, "\
+Usage: %s [-d serial | -i file] [-n points] [-a segments] [-r rate] [-F hz] [-o csv] [-u seconds]\n\
+\n\
+\t-a\t Average exponentially over this many segments, for a live view.\n\
+\t  \t Default: 0 (average all)\n\
+\t-d\t Set the USB CDC device\n\
+\t  \t e.g. /dev/ttyACM0 \t Default: /dev/ttyACM0\n\
+\t-F\t Set the nominal frequency in Hz.\n\
+\t  \t Default: mean of the first segment\n\
+\t-h\t Print this help.\n\
+\t-i\t Analyse a file instead, a CSV exported by freqlog or one value in Hz per line (needs -r). - for stdin.\n\
+\t-n\t Set the segment length, a power of 2.\n\
+\t  \t Default: 4096\n\
+\t-o\t Also write the full spectrum as CSV to this file on every update.\n\
+\t-r\t Set the sample rate in Hz.\n\
+\t  \t Default: from the device timestamps\n\
+\t-u\t Set the update interval in seconds.\n\
+\t  \t Default: 1\n\
+\n\
+Example: %s -d /dev/ttyACM0 -n 8192 -a 16 -o spectrum.csv\n\
+         ../freqlog/freqlog -x oscillator.flog | %s -i - -o spectrum.csv\n\
+\n", self, self, self);
+}
+
+static void handle_bad_opts(void) {
+  if (strchr("adFinoru", optopt)) {
+    fprintf(stderr, "ERROR: option -%c requires an argument.\n\n", optopt);
+  } else if (isprint(optopt)) {
+    fprintf(stderr, "ERROR: unknown option `-%c'.\n\n", optopt);
+  } else {
+    fprintf(stderr, "ERROR: unknown option character `\\x%x'.\n\n", optopt);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  static struct spectrum s;
+  struct input in = {.s = &s};
+  char   *device  = "/dev/ttyACM0";
+  char   *file    = NULL;
+  char   *csv     = NULL;
+  double  f0      = 0;
+  int     n       = 4096;
+  int     average = 0;
+  int     ret;
+
+  int c;
+  opterr = 0;
+  while ((c = getopt(argc, argv, "a:d:F:hi:n:o:r:u:")) != -1) {
+    switch (c) {
+      case 'a': {
+        average = atoi(optarg);
+        break;
+      }
+
+      case 'd': {
+        device = optarg;
+        break;
+      }
+
+      case 'F': {
+        f0 = strtod(optarg, NULL);
+        break;
+      }
+
+      case 'h': {
+        print_help(argv[0]);
+        return 0;
+      }
+
+      case 'i': {
+        file = optarg;
+        break;
+      }
+
+      case 'n': {
+        n = atoi(optarg);
+        break;
+      }
+
+      case 'o': {
+        csv = optarg;
+        break;
+      }
+
+      case 'r': {
+        in.rate = strtod(optarg, NULL);
+        break;
+      }
+
+      case 'u': {
+        show_ns = strtod(optarg, NULL) * 1e9;
+        break;
+      }
+
+      case '?': {
+        handle_bad_opts();
+        print_help(argv[0]);
+        return -EINVAL;
+      }
+
+      default: {
+        fprintf(stderr, "BUG: switch fall-through on `%c'!\n", c);
+        abort();
+      }
+    }
+  }
+
+  if ((n < 16) || (n & (n - 1)) || (average < 0)) {
+    print_help(argv[0]);
+    return -EINVAL;
+  }
+  if (spectrum_init(&s, n, average)) {
+    perror("ERROR: cannot allocate buffers");
+    return errno;
+  }
+  s.f0 = f0;
+
+  struct sigaction sa = {.sa_handler = sig_handler};
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  if (file) {
+    ret = run_file(&in, file, csv);
+  } else {
+    ret = run_device(&in, device, csv);
+  }
+
+  spectrum_finish(&s);
+  if (!s.segments) {
+    fprintf(stderr, "Not enough readings for one segment of %d (got %" PRIu64 ").\n", n, in.readings);
+    return ret;
+  }
+
+  show(&s, false);
+  if (csv && write_csv(&s, csv)) {
+    perror("ERROR: cannot write spectrum");
+  }
+  fprintf(stderr, "%" PRIu64 " readings, %" PRIu64 " filled in for readings lost on device or without signal\n",
+          in.readings, in.filled);
+
+  return ret;
+}
@@ -0,0 +1,462 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "libfreqmeter.h"
+
+/*
+ * Log file layout:
+ *   struct log_header, then chunks of LOG_CHUNK_SIZE bytes each, chunk k at LOG_HEADER_SIZE + k * LOG_CHUNK_SIZE.
+ *   Each chunk is a struct log_chunk (the index block) followed by up to LOG_CHUNK_RECORDS struct log_record.
+ * Record times are offsets from the chunk base, so records stay 16 bytes. A new chunk is started when the
+ * current one is full, when the offset would overflow, or when CLOCK_REALTIME steps against CLOCK_MONOTONIC.
+ * Chunks are directly addressable, so a time range is found by binary search over the index blocks and then
+ * over the records of one chunk, all through mmap() without reading the file.
+ */
+
+#define LOG_MAGIC         "FREQLOG2"
+#define LOG_MAGIC_V1      "FREQLOG1" /* Flags packed into a bitfield, no longer read. */
+#define LOG_CHUNK_MAGIC   0x4b4e4843 /* "CHNK" */
+#define LOG_HEADER_SIZE   64
+#define LOG_CHUNK_SIZE    65536
+#define LOG_CHUNK_RECORDS ((LOG_CHUNK_SIZE - sizeof(struct log_chunk)) / sizeof(struct log_record))
+#define LOG_STEP_NS       1000000   /* REALTIME vs MONOTONIC disagreement that starts a new chunk. */
+#define LOG_FLUSH_NS      1000000000
+
+struct log_header {
+  char     magic[8];
+  uint32_t header_size;
+  uint32_t chunk_size;
+  uint32_t record_size;
+  char     device[44];
+};
+
+struct log_chunk {
+  uint32_t magic;
+  uint32_t count;   /* Records in this chunk, updated on every flush. */
+  int64_t  mono_ns; /* CLOCK_MONOTONIC base. */
+  int64_t  real_ns; /* CLOCK_REALTIME at the same instant. */
+  uint8_t  reserved[40];
+};
+
+/* All fields little-endian, as written on x86 and ARM hosts. */
+struct log_record {
+  uint32_t mono_us;   /* Arrival time, offset from log_chunk.mono_ns. */
+  uint32_t device_us; /* Gate close on the device clock. */
+  uint32_t hz;
+  uint16_t mhz;       /* Fraction of hz in 1/1000. */
+  uint8_t  flags;     /* PROTO_FLAG_*, as in the binary stream. */
+  uint8_t  gap;       /* Records lost on the device right before this one, saturating. */
+};
+
+_Static_assert(sizeof(struct log_header) == LOG_HEADER_SIZE, "log header size");
+_Static_assert(sizeof(struct log_chunk) == 64, "log chunk size");
+_Static_assert(sizeof(struct log_record) == 16, "log record size");
+
+static volatile bool stop = false;
+
+static int64_t clock_ns(clockid_t id) {
+  struct timespec ts;
+
+  clock_gettime(id, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sig_handler(int signo) {
+  stop = true;
+}
+
+/* Writer state. Records of the open chunk are buffered and written out on flush. */
+struct log_writer {
+  int               fd;
+  uint64_t          chunk;     /* Index of the open chunk. */
+  struct log_chunk  head;
+  uint32_t          written;   /* Records of the open chunk already in the file. */
+  struct log_record buf[LOG_CHUNK_RECORDS];
+};
+
+static off_t log_chunk_offset(uint64_t chunk) {
+  return LOG_HEADER_SIZE + (off_t)chunk * LOG_CHUNK_SIZE;
+}
+
+static int log_flush(struct log_writer *w) {
+  off_t  off = log_chunk_offset(w->chunk) + sizeof(struct log_chunk) + w->written * sizeof(struct log_record);
+  size_t len = (w->head.count - w->written) * sizeof(struct log_record);
+
+  /* Data first, then the count that makes it visible to readers. */
+  if (len && (pwrite(w->fd, &w->buf[w->written], len, off) != (ssize_t)len)) {
+    return -1;
+  }
+  if (pwrite(w->fd, &w->head, sizeof(w->head), log_chunk_offset(w->chunk)) != sizeof(w->head)) {
+    return -1;
+  }
+  w->written = w->head.count;
+
+  return 0;
+}
+
+static int log_append(struct log_writer *w, const struct fm_reading *r) {
+  int64_t offset_ns = r->mono_ns - w->head.mono_ns;
+  int64_t step_ns   = (r->real_ns - w->head.real_ns) - offset_ns;
+  struct log_record *out;
+
+  if ((w->head.magic != LOG_CHUNK_MAGIC)
+      || (w->head.count >= LOG_CHUNK_RECORDS)
+      || (offset_ns / 1000 > UINT32_MAX)
+      || (step_ns > LOG_STEP_NS) || (step_ns < -LOG_STEP_NS)) {
+    /* Close the open chunk and start the next one here. */
+    if (w->head.magic == LOG_CHUNK_MAGIC) {
+      if (log_flush(w)) {
+        return -1;
+      }
+      w->chunk ++;
+    }
+    memset(&w->head, 0, sizeof(w->head));
+    w->head.magic   = LOG_CHUNK_MAGIC;
+    w->head.mono_ns = r->mono_ns;
+    w->head.real_ns = r->real_ns;
+    w->written      = 0;
+    offset_ns       = 0;
+  }
+
+  out = &w->buf[w->head.count ++];
+  out->mono_us   = offset_ns / 1000;
+  out->device_us = r->device_us;
+  out->hz        = r->mhz / 1000;
+  out->mhz       = r->mhz % 1000;
+  out->flags     = r->flags & 0xff;
+  out->gap       = (r->lost > 255) ? 255 : r->lost;
+
+  return 0;
+}
+
+struct recorder {
+  struct log_writer w;
+  bool              failed;
+};
+
+static void record_reading(const struct fm_reading *r, void *user) {
+  struct recorder *rec = user;
+
+  if (!rec->failed && log_append(&rec->w, r)) {
+    rec->failed = true;
+  }
+}
+
+static int do_record(const char *device, const char *path) {
+  static struct recorder   rec;
+  static struct fm_decoder dec;
+  struct log_header hdr = {
+    .magic       = LOG_MAGIC,
+    .header_size = LOG_HEADER_SIZE,
+    .chunk_size  = LOG_CHUNK_SIZE,
+    .record_size = sizeof(struct log_record),
+  };
+  int64_t mono_ns, last_flush = 0;
+  int     serial_fd;
+
+  strncpy(hdr.device, device, sizeof(hdr.device) - 1);
+
+  rec.w.fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (rec.w.fd < 0) {
+    perror("ERROR: cannot create log file");
+    return errno;
+  }
+  if (pwrite(rec.w.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+    perror("ERROR: cannot write log file");
+    return errno;
+  }
+
+  serial_fd = fm_serial_open(device);
+  if (serial_fd < 0) {
+    perror("ERROR: cannot open serial port");
+    return errno;
+  }
+
+  /* Switch to binary stream. Leftovers of a screen or text stream are skipped by the decoder. */
+  if (fm_select_stream(serial_fd, &dec, FM_STREAM_BINARY)) {
+    perror("ERROR: cannot write to serial port");
+    return errno;
+  }
+
+  while (!stop && !rec.failed) {
+    if (fm_decoder_read(&dec, serial_fd, record_reading, &rec) <= 0) {
+      if (!stop) {
+        perror("ERROR: cannot read from serial port");
+      }
+      break;
+    }
+
+    mono_ns = clock_ns(CLOCK_MONOTONIC);
+    if (mono_ns - last_flush > LOG_FLUSH_NS) {
+      if (log_flush(&rec.w)) {
+        rec.failed = true;
+        break;
+      }
+      last_flush = mono_ns;
+      fprintf(stderr, "\r%" PRIu64 " records, %" PRIu64 " lost on device", dec.readings, dec.lost);
+    }
+  }
+
+  if (rec.failed) {
+    perror("ERROR: cannot write log file");
+  }
+  if (rec.w.head.magic == LOG_CHUNK_MAGIC) {
+    log_flush(&rec.w);
+  }
+  close(rec.w.fd);
+  fm_serial_close(serial_fd);
+  fprintf(stderr, "\r%" PRIu64 " records, %" PRIu64 " lost on device\n", dec.readings, dec.lost);
+
+  return 0;
+}
+
+/* Reader, everything goes through the mapping. */
+struct log_reader {
+  const uint8_t *base;
+  size_t         size;
+  uint64_t       chunks;
+};
+
+static const struct log_chunk *log_chunk_at(const struct log_reader *r, uint64_t k) {
+  return (const struct log_chunk *)(r->base + log_chunk_offset(k));
+}
+
+static const struct log_record *log_records(const struct log_reader *r, uint64_t k) {
+  return (const struct log_record *)(r->base + log_chunk_offset(k) + sizeof(struct log_chunk));
+}
+
+/* Records actually present, a crashed writer may leave the count ahead of the data. */
+static uint32_t log_count(const struct log_reader *r, uint64_t k) {
+  const struct log_chunk *c = log_chunk_at(r, k);
+  size_t avail;
+
+  if ((log_chunk_offset(k) + sizeof(struct log_chunk) > r->size) || (c->magic != LOG_CHUNK_MAGIC)) {
+    return 0;
+  }
+  avail = (r->size - log_chunk_offset(k) - sizeof(struct log_chunk)) / sizeof(struct log_record);
+
+  return (c->count < avail) ? c->count : avail;
+}
+
+static int64_t log_real_ns(const struct log_chunk *c, const struct log_record *rec) {
+  return c->real_ns + (int64_t)rec->mono_us * 1000;
+}
+
+static int do_export(const char *path, int64_t from_ns, int64_t to_ns) {
+  struct log_reader r;
+  const struct log_header *hdr;
+  struct stat st;
+  uint64_t lo, hi, k;
+  uint32_t i, n;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if ((fd < 0) || fstat(fd, &st)) {
+    perror("ERROR: cannot open log file");
+    return errno;
+  }
+  if (st.st_size < LOG_HEADER_SIZE + sizeof(struct log_chunk)) {
+    fprintf(stderr, "ERROR: `%s' is empty.\n", path);
+    return -EINVAL;
+  }
+
+  r.size = st.st_size;
+  r.base = mmap(NULL, r.size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (r.base == MAP_FAILED) {
+    perror("ERROR: cannot map log file");
+    return errno;
+  }
+
+  hdr = (const struct log_header *)r.base;
+  if (!memcmp(hdr->magic, LOG_MAGIC_V1, sizeof(hdr->magic))) {
+    fprintf(stderr, "ERROR: `%s' was written in the old FREQLOG1 format, which is no longer supported.\n", path);
+    return -EINVAL;
+  }
+  if (memcmp(hdr->magic, LOG_MAGIC, sizeof(hdr->magic))
+      || (hdr->chunk_size != LOG_CHUNK_SIZE)
+      || (hdr->record_size != sizeof(struct log_record))) {
+    fprintf(stderr, "ERROR: `%s' is not a frequency log.\n", path);
+    return -EINVAL;
+  }
+  r.chunks = (r.size - LOG_HEADER_SIZE + LOG_CHUNK_SIZE - 1) / LOG_CHUNK_SIZE;
+  /* The file grows ahead of the writer, trailing chunks may have no header yet (real_ns 0) or no records. */
+  while (r.chunks && (log_count(&r, r.chunks - 1) == 0)) {
+    r.chunks --;
+  }
+
+  /* Last chunk starting at or before the range. Assumes CLOCK_REALTIME never stepped back. */
+  lo = 0;
+  hi = r.chunks;
+  while (hi - lo > 1) {
+    uint64_t mid = lo + (hi - lo) / 2;
+
+    if (log_chunk_at(&r, mid)->real_ns <= from_ns) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  printf("realtime,monotonic,device_us,frequency_hz,flags,lost\n");
+  for (k = lo; k < r.chunks; k ++) {
+    const struct log_chunk  *c   = log_chunk_at(&r, k);
+    const struct log_record *rec = log_records(&r, k);
+
+    n = log_count(&r, k);
+    if (n && log_real_ns(c, &rec[0]) > to_ns) {
+      break;
+    }
+
+    /* First record in range. */
+    i = 0;
+    if (k == lo) {
+      uint32_t a = 0, b = n;
+
+      while (a < b) {
+        uint32_t mid = a + (b - a) / 2;
+
+        if (log_real_ns(c, &rec[mid]) < from_ns) {
+          a = mid + 1;
+        } else {
+          b = mid;
+        }
+      }
+      i = a;
+    }
+
+    for (; i < n; i ++) {
+      int64_t real_ns = log_real_ns(c, &rec[i]);
+      int64_t mono_ns = c->mono_ns + (int64_t)rec[i].mono_us * 1000;
+
+      if (real_ns > to_ns) {
+        break;
+      }
+      printf("%" PRId64 ".%06" PRId64 ",%" PRId64 ".%06" PRId64 ",%" PRIu32 ",%" PRIu32 ".%03u,0x%02x,%u\n",
+        real_ns / 1000000000, (real_ns % 1000000000) / 1000,
+        mono_ns / 1000000000, (mono_ns % 1000000000) / 1000,
+        rec[i].device_us,
+        rec[i].hz, (unsigned)rec[i].mhz,
+        (unsigned)rec[i].flags,
+        (unsigned)rec[i].gap
+      );
+    }
+  }
+
+  munmap((void *)r.base, r.size);
+
+  return 0;
+}
+
+static void print_help(const char *self) {
+  fprintf(stderr, "\
+Usage: %s [-d serial] -o file\n\
+       %s -x file [-s start] [-e end]\n\
+\n\
+\t-d\t Set the USB CDC device\n\
+\t  \t e.g. /dev/ttyACM0 \t Default: /dev/ttyACM0\n\
+\t-e\t Export readings up to this time (Unix time in seconds).\n\
+\t-h\t Print this help.\n\
+\t-o\t Record the binary stream of the device to a new log file until interrupted.\n\
+\t-s\t Export readings from this time (Unix time in seconds).\n\
+\t-x\t Export a log file as CSV to standard output.\n\
+\n\
+Example: %s -d /dev/ttyACM1 -o oscillator.flog\n\
+         %s -x oscillator.flog -s 1700000000 -e 1700003600 > hour.csv\n\
+\n", self, self, self, self);
+}
+
+static void handle_bad_opts(void) {
+  if ((optopt == 'd') || (optopt == 'e') || (optopt == 'o') || (optopt == 's') || (optopt == 'x')) {
+    fprintf(stderr, "ERROR: option -%c requires an argument.\n\n", optopt);
+  } else if (isprint(optopt)) {
+    fprintf(stderr, "ERROR: unknown option `-%c'.\n\n", optopt);
+  } else {
+    fprintf(stderr, "ERROR: unknown option character `\\x%x'.\n\n", optopt);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  char    *device  = "/dev/ttyACM0";
+  char    *output  = NULL;
+  char    *export  = NULL;
+  int64_t from_ns  = INT64_MIN;
+  int64_t to_ns    = INT64_MAX;
+
+  int c;
+  opterr = 0;
+  while ((c = getopt(argc, argv, "d:e:ho:s:x:")) != -1) {
+    switch (c) {
+      case 'd': {
+        device = optarg;
+        break;
+      }
+
+      case 'e': {
+        to_ns = strtod(optarg, NULL) * 1e9;
+        break;
+      }
+
+      case 'h': {
+        print_help(argv[0]);
+        return 0;
+      }
+
+      case 'o': {
+        output = optarg;
+        break;
+      }
+
+      case 's': {
+        from_ns = strtod(optarg, NULL) * 1e9;
+        break;
+      }
+
+      case 'x': {
+        export = optarg;
+        break;
+      }
+
+      case '?': {
+        handle_bad_opts();
+        print_help(argv[0]);
+        return -EINVAL;
+      }
+
+      default: {
+        fprintf(stderr, "BUG: switch fall-through on `%c'!\n", c);
+        abort();
+      }
+    }
+  }
+
+  if (export) {
+    return do_export(export, from_ns, to_ns);
+  }
+
+  if (!output) {
+    print_help(argv[0]);
+    return -EINVAL;
+  }
+
+  /* Interrupted read() must return so that the log is closed cleanly. */
+  struct sigaction sa = {.sa_handler = sig_handler};
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  return do_record(device, output);
+}
@@ -0,0 +1,741 @@
+#define _GNU_SOURCE /* accept4() */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#include "libfreqmeter.h"
+
+/*
+ * One epoll loop owns every meter and every subscriber.
+ *
+ * Meters are identified by the serial number in their /dev/serial/by-id/ name, which the firmware derives
+ * from the unique ID of the chip. A slot is bound to that identity rather than to /dev/ttyACMn: it survives
+ * unplugging, keeps its ring of recent readings, and is picked up again by the periodic rescan on replug.
+ *
+ * Subscribers talk a line protocol on a Unix stream socket and keep one cursor per slot into its ring, so a
+ * reading is decoded and stored once no matter how many subscribers there are. A subscriber that falls
+ * behind by more than the ring loses the oldest readings (counted) instead of stalling the meters.
+ */
+
+#define MAX_DEVICES      64
+#define MAX_CLIENTS      64
+#define MAX_EVENTS       64
+#define MAX_PENDING      8    /* Per subscriber, meters subscribed to before they were first seen. */
+#define RING_SIZE        4096 /* Readings per meter, must be a power of 2. */
+#define ID_SIZE          64
+#define CLIENT_IN_SIZE   256
+#define CLIENT_OUT_SIZE  65536
+#define LINE_MAX_SIZE    128
+#define RESCAN_S         1
+
+#define BY_ID_PREFIX     "STM32-FREQMETER_"
+
+/* epoll_event.data.u64: source type in the upper half, slot index in the lower one. */
+#define SRC_LISTEN       1
+#define SRC_TIMER        2
+#define SRC_DEVICE       3
+#define SRC_CLIENT       4
+#define SRC(type, i)     (((uint64_t)(type) << 32) | (uint32_t)(i))
+
+struct device {
+  char              id[ID_SIZE];
+  char              path[FM_PATH_MAX];
+  int               fd;         /* -1 while unplugged. */
+  bool              reported;   /* Open failure already logged. */
+  uint64_t          head;       /* Readings ever stored. */
+  struct fm_reading ring[RING_SIZE];
+  struct fm_decoder dec;
+};
+
+struct client {
+  int      fd;
+  bool     all;                   /* Also follows meters showing up later. */
+  bool     sub[MAX_DEVICES];
+  uint64_t cursor[MAX_DEVICES];
+  char     pending[MAX_PENDING][ID_SIZE]; /* Empty string for a free entry. */
+  uint64_t dropped;
+  size_t   in_len;
+  size_t   out_start;
+  size_t   out_end;
+  bool     want_out;              /* EPOLLOUT armed. */
+  char     in[CLIENT_IN_SIZE];
+  char     out[CLIENT_OUT_SIZE];
+};
+
+static struct device *devices[MAX_DEVICES];
+static struct client *clients[MAX_CLIENTS];
+static int            n_devices = 0;
+static int            epfd      = -1;
+static bool           dirty     = false; /* New readings since the last fan-out. */
+
+static volatile bool  stop      = false;
+
+static void sig_handler(int signo) {
+  stop = true;
+}
+
+/* Serial number out of ".../usb-dword1511.info_STM32-FREQMETER_<serial>-if00", else the file name. */
+static void device_id(const char *path, char *id) {
+  const char *p = strstr(path, BY_ID_PREFIX);
+  const char *e;
+
+  if (p) {
+    p += strlen(BY_ID_PREFIX);
+    e = strstr(p, "-if");
+  } else {
+    p = strrchr(path, '/');
+    p = p ? p + 1 : path;
+    e = NULL;
+  }
+  if (!e) {
+    e = p + strlen(p);
+  }
+  if (e - p >= ID_SIZE) {
+    e = p + ID_SIZE - 1;
+  }
+
+  memcpy(id, p, e - p);
+  id[e - p] = '\0';
+}
+
+static int device_find(const char *id) {
+  int i;
+
+  for (i = 0; i < n_devices; i ++) {
+    if (!strcmp(devices[i]->id, id)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/* Entry of id in the subscriber's list of meters not seen yet, or -1. "" finds a free entry. */
+static int client_waiting(const struct client *cl, const char *id) {
+  int p;
+
+  for (p = 0; p < MAX_PENDING; p ++) {
+    if (!strncmp(cl->pending[p], id, ID_SIZE - 1)) {
+      return p;
+    }
+  }
+
+  return -1;
+}
+
+/*
+ * Slots are never freed, the identity of a meter stays valid across replugs. Only meters that were actually
+ * seen get one, subscriptions to others wait in the subscriber, so that bogus ids cannot use up the table.
+ */
+static int device_slot(const char *id) {
+  struct device *dev;
+  int i, c, p;
+
+  i = device_find(id);
+  if (i >= 0) {
+    return i;
+  }
+  if (n_devices == MAX_DEVICES) {
+    return -1;
+  }
+
+  dev = calloc(1, sizeof(*dev));
+  if (!dev) {
+    return -1;
+  }
+  snprintf(dev->id, sizeof(dev->id), "%s", id);
+  dev->fd = -1;
+
+  i = n_devices ++;
+  devices[i] = dev;
+  for (c = 0; c < MAX_CLIENTS; c ++) {
+    if (!clients[c]) {
+      continue;
+    }
+    p = client_waiting(clients[c], id);
+    if (p >= 0) {
+      clients[c]->pending[p][0] = '\0';
+    }
+    if (clients[c]->all || (p >= 0)) {
+      clients[c]->sub[i] = true;
+    }
+  }
+
+  return i;
+}
+
+static void device_store(const struct fm_reading *r, void *user) {
+  struct device *dev = user;
+
+  dev->ring[dev->head & (RING_SIZE - 1)] = *r;
+  dev->head ++;
+  dirty = true;
+}
+
+static void device_attach(const char *path) {
+  struct epoll_event ev = {.events = EPOLLIN};
+  struct device *dev;
+  char id[ID_SIZE];
+  int  i, fd;
+
+  device_id(path, id);
+  i = device_slot(id);
+  if (i < 0) {
+    return;
+  }
+  dev = devices[i];
+  if (dev->fd >= 0) {
+    return;
+  }
+
+  snprintf(dev->path, sizeof(dev->path), "%s", path);
+  fd = fm_serial_open(path);
+  if (fd < 0) {
+    if (!dev->reported) {
+      fprintf(stderr, "%s: cannot open %s: %s\n", id, path, strerror(errno));
+      dev->reported = true;
+    }
+    return;
+  }
+  if (fm_select_stream(fd, &dev->dec, FM_STREAM_BINARY)) {
+    fprintf(stderr, "%s: cannot select binary stream: %s\n", id, strerror(errno));
+    fm_serial_close(fd);
+    return;
+  }
+
+  ev.data.u64 = SRC(SRC_DEVICE, i);
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+    perror("ERROR: epoll_ctl");
+    fm_serial_close(fd);
+    return;
+  }
+
+  dev->fd       = fd;
+  dev->reported = false;
+  fprintf(stderr, "%s: attached %s\n", id, path);
+}
+
+static void device_detach(int i) {
+  struct device *dev = devices[i];
+
+  epoll_ctl(epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+  fm_serial_close(dev->fd);
+  dev->fd = -1;
+  fprintf(stderr, "%s: detached, %" PRIu64 " readings, %" PRIu64 " lost on device\n",
+          dev->id, dev->dec.readings, dev->dec.lost);
+}
+
+static void device_read(int i, uint32_t events) {
+  struct device *dev = devices[i];
+  ssize_t len = 0;
+
+  if (events & EPOLLIN) {
+    len = fm_decoder_read(&dev->dec, dev->fd, device_store, dev);
+  }
+  if ((len > 0) || ((len < 0) && (errno == EINTR))) {
+    /* A signal is handled by the main loop, the device stays. */
+    return;
+  }
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    device_detach(i);
+  }
+}
+
+static void rescan(char **extra, int n_extra) {
+  static char paths[MAX_DEVICES][FM_PATH_MAX];
+  int i, n;
+
+  n = fm_discover(paths, MAX_DEVICES);
+  for (i = 0; i < n; i ++) {
+    device_attach(paths[i]);
+  }
+  for (i = 0; i < n_extra; i ++) {
+    device_attach(extra[i]);
+  }
+}
+
+/* Subscribers */
+
+static void client_close(int c) {
+  struct client *cl = clients[c];
+
+  epoll_ctl(epfd, EPOLL_CTL_DEL, cl->fd, NULL);
+  close(cl->fd);
+  free(cl);
+  clients[c] = NULL;
+}
+
+static void client_accept(int listen_fd) {
+  struct epoll_event ev = {.events = EPOLLIN};
+  struct client *cl;
+  int fd, c;
+
+  fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+
+  for (c = 0; c < MAX_CLIENTS; c ++) {
+    if (!clients[c]) {
+      break;
+    }
+  }
+  cl = (c < MAX_CLIENTS) ? calloc(1, sizeof(*cl)) : NULL;
+  if (!cl) {
+    close(fd);
+    return;
+  }
+
+  cl->fd = fd;
+  ev.data.u64 = SRC(SRC_CLIENT, c);
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+    close(fd);
+    free(cl);
+    return;
+  }
+  clients[c] = cl;
+}
+
+/* Fails (and the caller drops the subscriber) only when a reply does not fit, i.e. it never reads. */
+static int client_printf(struct client *cl, const char *fmt, ...)
+__attribute__ ((format (printf, 2, 3)));
+
+static int client_printf(struct client *cl, const char *fmt, ...) {
+  va_list ap;
+  int     len;
+
+  va_start(ap, fmt);
+  len = vsnprintf(cl->out + cl->out_end, CLIENT_OUT_SIZE - cl->out_end, fmt, ap);
+  va_end(ap);
+
+  if ((len < 0) || ((size_t)len >= CLIENT_OUT_SIZE - cl->out_end)) {
+    return -1;
+  }
+  cl->out_end += len;
+  return 0;
+}
+
+static void client_subscribe(struct client *cl, int i, bool on, uint64_t backlog) {
+  struct device *dev = devices[i];
+
+  if (backlog > RING_SIZE) {
+    backlog = RING_SIZE;
+  }
+  if (backlog > dev->head) {
+    backlog = dev->head;
+  }
+
+  cl->sub[i]    = on;
+  cl->cursor[i] = dev->head - backlog;
+  if (backlog) {
+    dirty = true;
+  }
+}
+
+/*
+ * Commands, one per line:
+ *   list                 every known meter: id, online/offline, readings, lost on device, path
+ *   sub <id|*> [n]       follow a meter (or all, including future ones), replaying up to n stored readings
+ *   unsub <id|*>
+ */
+static int client_command(struct client *cl, char *line) {
+  char    *cmd, *arg, *save;
+  uint64_t backlog;
+  bool     on;
+  int      i, p;
+
+  cmd = strtok_r(line, " \t", &save);
+  arg = strtok_r(NULL, " \t", &save);
+  if (!cmd) {
+    return 0;
+  }
+
+  if (!strcmp(cmd, "list")) {
+    for (i = 0; i < n_devices; i ++) {
+      if (client_printf(cl, "# %s %s %" PRIu64 " %" PRIu64 " %s\n", devices[i]->id,
+                        (devices[i]->fd >= 0) ? "online" : "offline",
+                        devices[i]->head, devices[i]->dec.lost, devices[i]->path)) {
+        return -1;
+      }
+    }
+    return client_printf(cl, "# end\n");
+  }
+
+  on = !strcmp(cmd, "sub");
+  if ((!on && strcmp(cmd, "unsub")) || !arg) {
+    return client_printf(cl, "# error unknown command\n");
+  }
+  backlog = 0;
+  if (on && (cmd = strtok_r(NULL, " \t", &save)) != NULL) {
+    backlog = strtoull(cmd, NULL, 10);
+  }
+
+  if (!strcmp(arg, "*")) {
+    cl->all = on;
+    for (i = 0; i < n_devices; i ++) {
+      client_subscribe(cl, i, on, backlog);
+    }
+    if (!on) {
+      memset(cl->pending, 0, sizeof(cl->pending));
+    }
+    return client_printf(cl, "# ok\n");
+  }
+
+  i = device_find(arg);
+  if (i >= 0) {
+    client_subscribe(cl, i, on, backlog);
+    return client_printf(cl, "# ok\n");
+  }
+
+  /* Meters not seen yet wait in the subscriber, so one can subscribe before plugging them in. */
+  p = client_waiting(cl, arg);
+  if (!on) {
+    if (p < 0) {
+      return client_printf(cl, "# error no such meter\n");
+    }
+    cl->pending[p][0] = '\0';
+    return client_printf(cl, "# ok\n");
+  }
+  if (p < 0) {
+    p = client_waiting(cl, "");
+  }
+  if (p < 0) {
+    return client_printf(cl, "# error too many meters not seen yet\n");
+  }
+  snprintf(cl->pending[p], ID_SIZE, "%s", arg);
+  return client_printf(cl, "# ok\n");
+}
+
+static void client_read(int c) {
+  struct client *cl = clients[c];
+  ssize_t ret;
+  char   *nl;
+  size_t  used;
+
+  ret = read(cl->fd, cl->in + cl->in_len, CLIENT_IN_SIZE - 1 - cl->in_len);
+  if (ret <= 0) {
+    if ((ret < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+      return;
+    }
+    client_close(c);
+    return;
+  }
+  cl->in_len += ret;
+  cl->in[cl->in_len] = '\0';
+
+  used = 0;
+  while ((nl = strchr(cl->in + used, '\n')) != NULL) {
+    *nl = '\0';
+    if ((nl > cl->in + used) && (nl[-1] == '\r')) {
+      nl[-1] = '\0';
+    }
+    if (client_command(cl, cl->in + used)) {
+      client_close(c);
+      return;
+    }
+    used = nl + 1 - cl->in;
+  }
+
+  if (used) {
+    memmove(cl->in, cl->in + used, cl->in_len - used);
+    cl->in_len -= used;
+  } else if (cl->in_len == CLIENT_IN_SIZE - 1) {
+    /* Overlong line. */
+    client_close(c);
+  }
+}
+
+/* Formats as many pending readings as fit. */
+static void client_fill(struct client *cl) {
+  const struct fm_reading *r;
+  struct device *dev;
+  int i;
+
+  if (cl->out_start == cl->out_end) {
+    cl->out_start = cl->out_end = 0;
+  }
+
+  for (i = 0; i < n_devices; i ++) {
+    if (!cl->sub[i]) {
+      continue;
+    }
+    dev = devices[i];
+
+    if (dev->head - cl->cursor[i] > RING_SIZE) {
+      cl->dropped  += dev->head - cl->cursor[i] - RING_SIZE;
+      cl->cursor[i] = dev->head - RING_SIZE;
+    }
+
+    while ((cl->cursor[i] != dev->head) && (CLIENT_OUT_SIZE - cl->out_end >= LINE_MAX_SIZE)) {
+      r = &dev->ring[cl->cursor[i] & (RING_SIZE - 1)];
+      cl->out_end += snprintf(cl->out + cl->out_end, LINE_MAX_SIZE,
+                              "%s %" PRId64 ".%06" PRId64 " %" PRIu64 ".%03u %u %u %" PRIu64 "\n",
+                              dev->id, r->real_ns / 1000000000, (r->real_ns % 1000000000) / 1000,
+                              r->mhz / 1000, (unsigned)(r->mhz % 1000), r->lost, r->flags, cl->dropped);
+      cl->cursor[i] ++;
+    }
+  }
+}
+
+static bool client_pending(const struct client *cl) {
+  int i;
+
+  for (i = 0; i < n_devices; i ++) {
+    if (cl->sub[i] && (cl->cursor[i] != devices[i]->head)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void client_flush(int c) {
+  struct client *cl = clients[c];
+  struct epoll_event ev;
+  ssize_t ret;
+  bool    want;
+
+  client_fill(cl);
+
+  while (cl->out_start != cl->out_end) {
+    ret = write(cl->fd, cl->out + cl->out_start, cl->out_end - cl->out_start);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN) {
+        break;
+      }
+      client_close(c);
+      return;
+    }
+    cl->out_start += ret;
+
+    if (cl->out_start == cl->out_end) {
+      client_fill(cl);
+    }
+  }
+
+  /* Only wait for the socket while something is left, otherwise EPOLLOUT would fire all the time. */
+  want = (cl->out_start != cl->out_end) || client_pending(cl);
+  if (want != cl->want_out) {
+    ev.events   = EPOLLIN | (want ? EPOLLOUT : 0);
+    ev.data.u64 = SRC(SRC_CLIENT, c);
+    epoll_ctl(epfd, EPOLL_CTL_MOD, cl->fd, &ev);
+    cl->want_out = want;
+  }
+}
+
+static int listen_unix(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, MAX_CLIENTS)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void print_help(const char *self) {
+  fprintf(stderr, "\
+Usage: %s [-s socket] [-d serial]...\n\
+\n\
+\t-d\t Also serve this device, may be repeated. Meters in /dev/serial/by-id/ are found automatically.\n\
+\t-h\t Print this help.\n\
+\t-s\t Set the Unix socket to serve readings on.\n\
+\t  \t Default: /tmp/freqmeterd.sock\n\
+\n\
+Example: %s -s /run/freqmeterd.sock\n\
+\n", self, self);
+}
+
+static void handle_bad_opts(void) {
+  if ((optopt == 'd') || (optopt == 's')) {
+    fprintf(stderr, "ERROR: option -%c requires an argument.\n\n", optopt);
+  } else if (isprint(optopt)) {
+    fprintf(stderr, "ERROR: unknown option `-%c'.\n\n", optopt);
+  } else {
+    fprintf(stderr, "ERROR: unknown option character `\\x%x'.\n\n", optopt);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  static char *extra[MAX_DEVICES];
+  static struct epoll_event events[MAX_EVENTS];
+  struct epoll_event ev = {.events = EPOLLIN};
+  struct itimerspec  its = {
+    .it_interval = {.tv_sec = RESCAN_S},
+    .it_value    = {.tv_nsec = 1},
+  };
+  char    *socket_path = "/tmp/freqmeterd.sock";
+  int      n_extra     = 0;
+  int      listen_fd, timer_fd;
+  uint64_t expirations;
+  int      i, n;
+
+  int c;
+  opterr = 0;
+  while ((c = getopt(argc, argv, "d:hs:")) != -1) {
+    switch (c) {
+      case 'd': {
+        if (n_extra < MAX_DEVICES) {
+          extra[n_extra ++] = optarg;
+        }
+        break;
+      }
+
+      case 'h': {
+        print_help(argv[0]);
+        return 0;
+      }
+
+      case 's': {
+        socket_path = optarg;
+        break;
+      }
+
+      case '?': {
+        handle_bad_opts();
+        print_help(argv[0]);
+        return -EINVAL;
+      }
+
+      default: {
+        fprintf(stderr, "BUG: switch fall-through on `%c'!\n", c);
+        abort();
+      }
+    }
+  }
+
+  struct sigaction sa = {.sa_handler = sig_handler};
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    perror("ERROR: epoll_create1");
+    return errno;
+  }
+
+  listen_fd = listen_unix(socket_path);
+  if (listen_fd < 0) {
+    perror("ERROR: cannot listen on socket");
+    return errno;
+  }
+  ev.data.u64 = SRC(SRC_LISTEN, 0);
+  epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if ((timer_fd < 0) || timerfd_settime(timer_fd, 0, &its, NULL)) {
+    perror("ERROR: timerfd");
+    return errno;
+  }
+  ev.data.u64 = SRC(SRC_TIMER, 0);
+  epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &ev);
+
+  while (!stop) {
+    n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("ERROR: epoll_wait");
+      break;
+    }
+
+    for (i = 0; i < n; i ++) {
+      uint32_t idx = (uint32_t)events[i].data.u64;
+
+      switch (events[i].data.u64 >> 32) {
+        case SRC_LISTEN: {
+          client_accept(listen_fd);
+          break;
+        }
+
+        case SRC_TIMER: {
+          if (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+            rescan(extra, n_extra);
+          }
+          break;
+        }
+
+        case SRC_DEVICE: {
+          if (devices[idx]->fd >= 0) {
+            device_read(idx, events[i].events);
+          }
+          break;
+        }
+
+        case SRC_CLIENT: {
+          if (!clients[idx]) {
+            break;
+          }
+          if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+            client_close(idx);
+          } else if (events[i].events & EPOLLIN) {
+            client_read(idx);
+          }
+          /* Replies to commands, or room again after a stall. */
+          if (clients[idx]) {
+            client_flush(idx);
+          }
+          break;
+        }
+      }
+    }
+
+    /* Fan out once per batch of events, so readings of many meters share write() calls. */
+    for (c = 0; c < MAX_CLIENTS; c ++) {
+      if (dirty && clients[c]) {
+        client_flush(c);
+      }
+    }
+    dirty = false;
+  }
+
+  for (i = 0; i < n_devices; i ++) {
+    if (devices[i]->fd >= 0) {
+      device_detach(i);
+    }
+  }
+  for (c = 0; c < MAX_CLIENTS; c ++) {
+    if (clients[c]) {
+      client_close(c);
+    }
+  }
+  close(listen_fd);
+  unlink(socket_path);
+
+  return 0;
+}
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <inttypes.h>
 #include <math.h>
 #include <sys/types.h>
@@ -13,116 +14,168 @@
 #include <sys/ioctl.h>
 #include <termios.h>
 
-#define SERIAL_LINEBUF_SIZE 512
-
-static void serial_close(int fd) {
-  int result = -1;
-
-  if (fd > 0) {
-    do {
-      result = close(fd);
-    } while (result == -1 && errno == EINTR);
+#include "libfreqmeter.h"
+
+#define MAX_WINDOW 256
+#define OPEN_GATES 3   /* Open readings in a row before the next DUT is expected. */
+
+/*
+ * Settling detection (-s): the readings of the last `window' gates are fitted with a line. The DUT has settled
+ * once both the drift over the window (slope times its length) and the scatter around the line are below
+ * `tolerance', relative to the mean. One value is then printed per DUT, and nothing more until the test leads
+ * go open, or the inductance jumps (a part swapped without lifting the leads).
+ *
+ * Only full-gate live readings are fitted: PRELIM and HOLD readings are dropped, and an open reading counts
+ * only as the leads going open once OPEN_GATES of them come in a row, so that a dropout does not re-arm.
+ */
+
+enum settle_state {
+  SETTLE_OPEN,     /* Nothing connected. */
+  SETTLE_WAIT,     /* DUT connected, not stable yet. */
+  SETTLE_DONE,     /* Value printed for this DUT. */
+};
+
+struct henry {
+  double capacitance; /* F. */
+  double offset;      /* H. */
+
+  bool     settle;
+  unsigned window;
+  double   tolerance; /* Relative. */
+
+  enum settle_state state;
+  double   ring[MAX_WINDOW]; /* Inductance, H, without offset. */
+  unsigned n;
+  unsigned head;
+  double   settled;    /* H, without offset. */
+  unsigned open;       /* Open readings in a row. */
+  int64_t  since_ns;   /* First reading of this DUT. */
+  unsigned duts;
+};
+
+/* Inductance in H before the offset, INFINITY for an open circuit. */
+static double inductance(const struct henry *h, double freq) {
+  double ind;
+
+  if (freq == 0) {
+    return INFINITY;
   }
-}
-
-static int serial_open(const char *device_path) {
-  int fd = -1;
 
-  /* NULL or empty string. */
-  if (!device_path || !*device_path) {
-    return -EINVAL;
+  ind = (1.0f / (4 * M_PI * M_PI)) / (freq * freq) / h->capacitance;
+  if (ind > 10) {
+    /* L > 10H must be open circuit.*/
+    ind = INFINITY;
   }
 
-  do {
-    fd = open(device_path, O_RDWR | O_NOCTTY);
-  } while (fd == -1 && errno == EINTR);
+  return ind;
+}
 
-  if (fd < 0) {
-    /* Failed to open file. */
-    return fd;
+/*
+ * Least-squares line through the window. Returns true if settled, with the mean and its uncertainty: the
+ * standard error of the mean, combined with half the drift still left over the window.
+ */
+static bool settle_check(const struct henry *h, double *mean, double *error) {
+  double   sx = 0, sxx = 0, sy = 0, sxy = 0, ssr = 0;
+  double   x, y, slope, intercept, r;
+  unsigned i, n = h->window;
+
+  for (i = 0; i < n; i ++) {
+    x    = i;
+    y    = h->ring[(h->head + i) % n]; /* Oldest first. */
+    sx  += x;
+    sxx += x * x;
+    sy  += y;
+    sxy += x * y;
   }
-
-  if (ioctl(fd, TIOCEXCL)) {
-    /* Failed to set IO exclusive, close it. */
-    serial_close(fd);
-    return -EIO;
+  slope     = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+  intercept = (sy - slope * sx) / n;
+  for (i = 0; i < n; i ++) {
+    r    = h->ring[(h->head + i) % n] - (intercept + slope * i);
+    ssr += r * r;
   }
 
-  /* Basic serial IO setup. */
-  /* Most common config. USB CDC without real serial does not care anyway. */
-  struct termios tio = {
-    .c_cflag = B115200 | CS8 | CLOCAL | CREAD,
-    .c_iflag = 0,
-    .c_oflag = 0,
-    .c_lflag = NOFLSH,
-    .c_cc = {0},
-  };
-  tio.c_cc[VMIN]  = 1; /* Wait until 1 char available (blocking read). */
-  tio.c_cc[VTIME] = 0; /* Blocking read.                               */
-
-  if (tcsetattr(fd, TCSANOW, &tio)) {
-    /* Failed to apply settings. */
-    return -1;
-  } else {
-    tcflush(fd, TCIFLUSH);
-    return fd;
-  }
+  *mean  = sy / n;
+  *error = sqrt(ssr / (n - 2) / n + pow(slope * (n - 1) / 2, 2));
+
+  return (fabs(slope * (n - 1)) <= h->tolerance * *mean) && (sqrt(ssr / (n - 2)) <= h->tolerance * *mean);
 }
 
-/* Blocking read, returns 0 on error. */
-static unsigned char serial_getc(int fd) {
-  unsigned char c = 0;
+static void settle_reading(struct henry *h, const struct fm_reading *r, double ind) {
+  double mean, error;
 
-  if(fd > 0) {
-    if (read(fd, &c, 1)) {
-      return c;
-    } else {
-      return 0;
+  if (r->flags & (PROTO_FLAG_PRELIM | PROTO_FLAG_HOLD)) {
+    return;
+  }
+  if (isinf(ind) || (r->flags & PROTO_FLAG_LOS)) {
+    h->open ++;
+    if (h->open >= OPEN_GATES) {
+      h->state = SETTLE_OPEN;
     }
-  } else {
-    return 0;
+    return;
   }
-}
-
-static void serial_wait_line(int fd) {
-  unsigned char c = 0;
+  h->open = 0;
 
-  do {
-    c = serial_getc(fd);
-  } while (c != 0 && c != '\n' && c != '\r');
-}
+  if ((h->state == SETTLE_DONE) && (fabs(ind - h->settled) > 10 * h->tolerance * h->settled)) {
+    /* Another part, without the leads going open in between. */
+    h->state = SETTLE_OPEN;
+  }
 
-static int serial_read_line(int fd, char *buf, int size) {
-  unsigned char c = 0;
+  switch (h->state) {
+    case SETTLE_OPEN: {
+      h->state    = SETTLE_WAIT;
+      h->n        = 0;
+      h->head     = 0;
+      h->since_ns = r->mono_ns;
+      /* Fall through. */
+    }
 
-  if (!buf || !size) {
-    return -EINVAL;
-  } else {
-    /* Wait for a new line. */
-    serial_wait_line(fd);
+    case SETTLE_WAIT: {
+      h->ring[h->head] = ind;
+      h->head = (h->head + 1) % h->window;
+      if (h->n < h->window) {
+        h->n ++;
+      }
+      if ((h->n == h->window) && settle_check(h, &mean, &error)) {
+        h->state   = SETTLE_DONE;
+        h->settled = mean;
+        h->duts ++;
+        fprintf(stdout, "%6u %15.3lf uH +/- %.3lf uH (settled in %.2lf s)\n",
+                h->duts, (mean - h->offset) * 1e6, error * 1e6, (r->mono_ns - h->since_ns) / 1e9);
+        fflush(stdout);
+      }
+      break;
+    }
 
-    /* First char needs care (CR+LF problem): skip all \n\r mess. */
-    c = serial_getc(fd);
-    while ((c == '\n') || (c == '\r')) {
-      c = serial_getc(fd);
+    case SETTLE_DONE: {
+      break;
     }
-    *buf = c;
-    size --;
+  }
+}
 
-    do {
-      buf ++;
-      *buf = serial_getc(fd);
-      size --;
-    } while ((*buf != 0) && (*buf != '\n') && (*buf != '\r') && (size > 0));
-    *buf = '\0';
+static void show_reading(const struct fm_reading *r, void *user) {
+  struct henry *h = user;
+  double freq = r->mhz / 1e3; /* mHz -> Hz. */
+  double ind;
+  char   dot  = (r->flags & FM_FLAG_DOT) ? '.' : ' ';
 
-    return 0;
+  if (h->settle) {
+    settle_reading(h, r, inductance(h, freq));
+    return;
   }
+
+  if (0 == r->mhz) {
+    fprintf(stdout, "%15.3lf uH %c (%9.0lf Hz)\r", 0.0f, dot, freq);
+  } else {
+    ind = inductance(h, freq) - h->offset;
+    fprintf(stdout, "%15.3lf uH %c (%9.0lf Hz)\r", ind * 1e6, dot, freq); /* H -> uH. */
+  }
+
+  fflush(stdout); /* Required if '\n' not present. */
 }
 
 static void print_help(const char *self) {
   fprintf(stderr, "\
-Usage: %s [-d serial] [-c cap] [-p]\n\
+Usage: %s [-d serial] [-c cap] [-p] [-s] [-w readings] [-t ppm]\n\
 \n\
 \t-c\t Set reference capacitance in the shorthand picofarad notation.\n\
 \t  \t e.g. 104 = 100nF \t Default: 223 (22nF)\n\
@@ -133,14 +186,19 @@ Usage: %s [-d serial] [-c cap] [-p]\n\
 \t  \t e.g. 105 = 1mH \t Default: 0 (no offset)\n\
 \t-p\t Set this parameter when Pierce/Colpitts oscillator is used.\n\
 \t  \t Capacitance will be halved.\n\
+\t-s\t Print one settled value per DUT instead of every reading.\n\
+\t-t\t Set the settling tolerance in ppm of the inductance, for -s.\n\
+\t  \t Default: 1000\n\
+\t-w\t Set the settling window in readings (3 to %d), for -s.\n\
+\t  \t Default: 10\n\
 \n\
 Example: %s -d /dev/ttyACM1 -c 224 -p -o 104\n\
 (220nF Cref, 100uH offset, Pierce/Colpitts oscillator, on ttyACM1)\n\
-\n", self, self);
+\n", self, MAX_WINDOW, self);
 }
 
 static void handle_bad_opts(void) {
-  if ((optopt == 'c') || (optopt == 'd')) {
+  if ((optopt == 'c') || (optopt == 'd') || (optopt == 'o') || (optopt == 't') || (optopt == 'w')) {
     fprintf(stderr, "ERROR: option -%c requires an argument.\n\n", optopt);
   } else if (isprint(optopt)) {
     fprintf(stderr, "ERROR: unknown option `-%c'.\n\n", optopt);
@@ -154,10 +212,13 @@ int main(int argc, char *argv[]) {
   double capacitance = 22e-9; /* F, default to 22nF. */
   double offset      = 0.00f; /* H, detault to no offset. */
   char   *device     = "/dev/ttyACM0";
+  bool   settle      = false;
+  int    window      = 10;
+  double tolerance   = 1000; /* ppm. */
 
   int c;
   opterr = 0;
-  while ((c = getopt(argc, argv, "c:d:ho:p")) != -1) {
+  while ((c = getopt(argc, argv, "c:d:ho:pst:w:")) != -1) {
     switch (c) {
       case 'c': {
         /* Set capacitance. */
@@ -220,6 +281,24 @@ int main(int argc, char *argv[]) {
         break;
       }
 
+      case 's': {
+        /* One value per DUT. */
+        settle = true;
+        break;
+      }
+
+      case 't': {
+        /* Set settling tolerance. */
+        tolerance = strtod(optarg, NULL);
+        break;
+      }
+
+      case 'w': {
+        /* Set settling window. */
+        window = atoi(optarg);
+        break;
+      }
+
       case '?': {
         handle_bad_opts();
         print_help(argv[0]);
@@ -233,64 +312,53 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  fprintf(stdout, "Device: %s\nCapacitance: %.3lf nF\nPierce/Colpitts: %s\nOffset: %.3lf uH\n\n",
+  if ((window < 3) || (window > MAX_WINDOW) || (tolerance <= 0)) {
+    print_help(argv[0]);
+    return -EINVAL;
+  }
+
+  fprintf(stdout, "Device: %s\nCapacitance: %.3lf nF\nPierce/Colpitts: %s\nOffset: %.3lf uH\n",
            device,
            capacitance * 1e9,
            pierce ? "yes" : "no",
            offset * 1e6
          );
+  if (settle) {
+    fprintf(stdout, "Settling: %d readings within %.0lf ppm\n", window, tolerance);
+  }
+  fprintf(stdout, "\n");
   if (pierce) {
     capacitance /= 2;
   }
 
   /* Setup serial. */
   int  serial_fd = -1;
-  serial_fd = serial_open(device);
+  serial_fd = fm_serial_open(device);
   if (serial_fd < 0) {
     perror("ERROR: cannot open serial port");
     return errno;
   }
 
+  /* Ask for one line per reading instead of the screen. */
+  static struct fm_decoder dec;
+  if (fm_select_stream(serial_fd, &dec, FM_STREAM_TEXT)) {
+    perror("ERROR: cannot write to serial port");
+    return errno;
+  }
+
   /* Main loop. */
-  char buf[SERIAL_LINEBUF_SIZE];
-  double  freq, ind;
-  char    dot;
+  static struct henry h;
+  h.capacitance = capacitance;
+  h.offset      = offset;
+  h.settle      = settle;
+  h.window      = window;
+  h.tolerance   = tolerance / 1e6;
+  h.state       = SETTLE_OPEN;
   while (true) {
-    if (0 != serial_read_line(serial_fd, buf, SERIAL_LINEBUF_SIZE)) {
+    if (fm_decoder_read(&dec, serial_fd, show_reading, &h) <= 0) {
       fprintf(stderr, "ERROR: cannot read from serial port!\n");
       return -1;
     }
-
-    if (2 != sscanf(buf, "%lf MHz %c", &freq, &dot)) {
-      fprintf(stderr, "ERROR: cannot parse frequency from line `%s'!\n", buf);
-      return -1;
-    }
-
-    if (freq < 0.0f) {
-      fprintf(stderr, "ERROR: invalid frequency `%lf'!\n", freq);
-      return -1;
-    }
-
-    if ('.' != dot) {
-      dot = ' ';
-    }
-
-    freq *= 1e6; /* MHz -> Hz. */
-    if (0.0f == freq) {
-      fprintf(stdout, "%15.3lf uH %c (%9.0lf Hz)\r", 0.0f, dot, freq);
-    } else {
-      ind = (1.0f / (4 * M_PI * M_PI)) / (freq * freq) / capacitance;
-
-      if (ind > 10) {
-        /* L > 10H must be open circuit.*/
-        ind = INFINITY;
-      }
-
-      ind -= offset;
-      fprintf(stdout, "%15.3lf uH %c (%9.0lf Hz)\r", ind * 1e6, dot, freq); /* H -> uH. */
-    }
-
-    fflush(stdout); /* Required if '\n' not present. */
   }
 
   return 0;
@@ -0,0 +1,454 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <glob.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <termios.h>
+
+#include "libfreqmeter.h"
+
+#define FM_DISCOVER_GLOB "/dev/serial/by-id/*STM32-FREQMETER*"
+
+static int64_t clock_ns(clockid_t id) {
+  struct timespec ts;
+
+  clock_gettime(id, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int fm_discover(char paths[][FM_PATH_MAX], int max) {
+  glob_t g;
+  int    i, n;
+
+  if (glob(FM_DISCOVER_GLOB, 0, NULL, &g)) {
+    return 0;
+  }
+
+  n = (g.gl_pathc < max) ? g.gl_pathc : max;
+  for (i = 0; i < n; i ++) {
+    snprintf(paths[i], FM_PATH_MAX, "%s", g.gl_pathv[i]);
+  }
+  globfree(&g);
+
+  return n;
+}
+
+void fm_serial_close(int fd) {
+  int result = -1;
+
+  if (fd > 0) {
+    do {
+      result = close(fd);
+    } while (result == -1 && errno == EINTR);
+  }
+}
+
+int fm_serial_open(const char *device_path) {
+  int fd = -1;
+
+  /* NULL or empty string. */
+  if (!device_path || !*device_path) {
+    errno = EINVAL;
+    return -EINVAL;
+  }
+
+  do {
+    fd = open(device_path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  } while (fd == -1 && errno == EINTR);
+
+  if (fd < 0) {
+    /* Failed to open file. */
+    return fd;
+  }
+
+  if (ioctl(fd, TIOCEXCL)) {
+    /* Failed to set IO exclusive, close it. */
+    fm_serial_close(fd);
+    errno = EBUSY;
+    return -EIO;
+  }
+
+  /* Basic serial IO setup. */
+  /* Most common config. USB CDC without real serial does not care anyway. */
+  struct termios tio = {
+    .c_cflag = B115200 | CS8 | CLOCAL | CREAD,
+    .c_iflag = 0,
+    .c_oflag = 0,
+    .c_lflag = NOFLSH,
+    .c_cc = {0},
+  };
+  tio.c_cc[VMIN]  = 1; /* Wait until 1 char available (blocking read). */
+  tio.c_cc[VTIME] = 0; /* Blocking read.                               */
+
+  if (tcsetattr(fd, TCSANOW, &tio)) {
+    /* Failed to apply settings. */
+    fm_serial_close(fd);
+    return -1;
+  } else {
+    tcflush(fd, TCIFLUSH);
+    return fd;
+  }
+}
+
+int fm_send(int fd, const char *cmd) {
+  size_t  len = strlen(cmd);
+  ssize_t ret;
+
+  while (len) {
+    ret = write(fd, cmd, len);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    cmd += ret;
+    len -= ret;
+  }
+
+  return 0;
+}
+
+int fm_select_stream(int fd, struct fm_decoder *dec, enum fm_stream mode) {
+  fm_decoder_init(dec, mode);
+  return fm_send(fd, (mode == FM_STREAM_BINARY) ? "b" : "s");
+}
+
+/*
+ * Fixed-point parser for "%4lu.%06lu MHz %c [Hold: %s]", keeping up to 9 decimals of the MHz value so that
+ * sub-Hz readings survive. Flags after the closing bracket are recognized as well.
+ */
+bool fm_parse_line(const char *p, size_t len, struct fm_reading *r) {
+  const char *end = p + len;
+  uint64_t    val = 0;
+  int         decimals = 0;
+
+  while ((p < end) && (*p == ' ')) {
+    p ++;
+  }
+  if ((p == end) || (*p < '0') || (*p > '9')) {
+    return false;
+  }
+  while ((p < end) && (*p >= '0') && (*p <= '9')) {
+    val = val * 10 + (*p ++ - '0');
+  }
+  if ((p < end) && (*p == '.')) {
+    p ++;
+    while ((p < end) && (*p >= '0') && (*p <= '9')) {
+      if (decimals < 9) {
+        val = val * 10 + (*p - '0');
+        decimals ++;
+      }
+      p ++;
+    }
+  }
+  /* MHz with 9 decimals is mHz. */
+  while (decimals < 9) {
+    val *= 10;
+    decimals ++;
+  }
+
+  if ((end - p < 6) || memcmp(p, " MHz ", 5)) {
+    return false;
+  }
+  p += 5;
+
+  memset(r, 0, sizeof(*r));
+  r->mhz = val;
+  if (*p == '.') {
+    r->flags |= FM_FLAG_DOT;
+  }
+  p ++;
+
+  for (; p < end; p ++) {
+    if ((end - p >= 9) && !memcmp(p, "Hold: ON ", 9)) {
+      r->flags |= PROTO_FLAG_HOLD;
+    } else if ((end - p >= 6) && !memcmp(p, "PRELIM", 6)) {
+      r->flags |= PROTO_FLAG_PRELIM;
+    } else if ((end - p >= 4) && !memcmp(p, "BOTH", 4)) {
+      r->flags |= PROTO_FLAG_BOTH;
+    } else if ((end - p >= 3) && !memcmp(p, "FIT", 3)) {
+      r->flags |= PROTO_FLAG_FIT;
+    }
+  }
+
+  return true;
+}
+
+void fm_decoder_init(struct fm_decoder *dec, enum fm_stream mode) {
+  dec->mode     = mode;
+  dec->synced   = false;
+  dec->seq      = 0;
+  dec->start    = 0;
+  dec->end      = 0;
+  dec->readings = 0;
+  dec->errors   = 0;
+  dec->lost     = 0;
+}
+
+uint8_t *fm_decoder_space(struct fm_decoder *dec, size_t *len) {
+  *len = sizeof(dec->buf) - dec->end;
+  return dec->buf + dec->end;
+}
+
+static void fm_decode_text(struct fm_decoder *dec, int64_t mono_ns, int64_t real_ns, fm_callback cb, void *user) {
+  struct fm_reading r;
+  uint8_t *line, *eol;
+
+  while (true) {
+    line = dec->buf + dec->start;
+    eol  = line;
+    while ((eol < dec->buf + dec->end) && (*eol != '\r') && (*eol != '\n')) {
+      eol ++;
+    }
+    if (eol == dec->buf + dec->end) {
+      return;
+    }
+    dec->start = eol + 1 - dec->buf;
+
+    if (!dec->synced) {
+      /* Whatever was on the wire before this line ended. */
+      dec->synced = true;
+      continue;
+    }
+    if (eol == line) {
+      /* Second half of CR+LF. */
+      continue;
+    }
+
+    if (!fm_parse_line((const char *)line, eol - line, &r)) {
+      dec->errors ++;
+      continue;
+    }
+    r.mono_ns = mono_ns;
+    r.real_ns = real_ns;
+    dec->readings ++;
+    if (cb) {
+      cb(&r, user);
+    }
+  }
+}
+
+static void fm_decode_binary(struct fm_decoder *dec, int64_t mono_ns, int64_t real_ns, fm_callback cb, void *user) {
+  struct fm_reading r = {
+    .mono_ns = mono_ns,
+    .real_ns = real_ns,
+  };
+  struct proto_record rec;
+  uint16_t gap;
+
+  while (dec->end - dec->start >= sizeof(rec)) {
+    memcpy(&rec, dec->buf + dec->start, sizeof(rec));
+    if ((rec.sync != PROTO_SYNC) || (rec.check != proto_check(&rec))) {
+      /* Resynchronize byte by byte, e.g. on the tail of a text stream. */
+      dec->start ++;
+      dec->errors ++;
+      continue;
+    }
+    dec->start += sizeof(rec);
+
+    if (rec.flags & PROTO_FLAG_TIME) {
+      /* Reply to a time probe, not a reading: no sequence number of its own. */
+      r.mhz       = 0;
+      r.device_us = rec.time_us;
+      r.seq       = rec.seq;
+      r.lost      = 0;
+      r.flags     = rec.flags;
+      if (cb) {
+        cb(&r, user);
+      }
+      continue;
+    }
+
+    gap = dec->synced ? (uint16_t)(rec.seq - dec->seq - 1) : 0;
+    dec->seq    = rec.seq;
+    dec->synced = true;
+    dec->lost  += gap;
+    dec->readings ++;
+
+    r.mhz       = (uint64_t)rec.hz * 1000 + rec.mhz;
+    r.device_us = rec.time_us;
+    r.seq       = rec.seq;
+    r.lost      = gap;
+    r.flags     = rec.flags;
+    if (cb) {
+      cb(&r, user);
+    }
+  }
+}
+
+void fm_decoder_feed(struct fm_decoder *dec, size_t len, fm_callback cb, void *user) {
+  /* Everything that arrived in one read() shares its arrival time. */
+  int64_t mono_ns = clock_ns(CLOCK_MONOTONIC);
+  int64_t real_ns = clock_ns(CLOCK_REALTIME);
+
+  dec->end += len;
+
+  if (dec->mode == FM_STREAM_BINARY) {
+    fm_decode_binary(dec, mono_ns, real_ns, cb, user);
+  } else {
+    fm_decode_text(dec, mono_ns, real_ns, cb, user);
+  }
+
+  /* Keep the incomplete tail at the front for the next read. */
+  if (dec->start == dec->end) {
+    dec->start = dec->end = 0;
+  } else if (dec->end == sizeof(dec->buf)) {
+    if (dec->start == 0) {
+      /* A full buffer without a single line in it, not our data. */
+      dec->errors ++;
+      dec->end = 0;
+    } else {
+      memmove(dec->buf, dec->buf + dec->start, dec->end - dec->start);
+      dec->end  -= dec->start;
+      dec->start = 0;
+    }
+  }
+}
+
+ssize_t fm_decoder_read(struct fm_decoder *dec, int fd, fm_callback cb, void *user) {
+  size_t   space;
+  uint8_t *buf = fm_decoder_space(dec, &space);
+  ssize_t  len;
+
+  /* Not retried on EINTR, so that a signal handler setting a stop flag gets the caller out of a silent device. */
+  len = read(fd, buf, space);
+  if (len > 0) {
+    fm_decoder_feed(dec, len, cb, user);
+  }
+
+  return len;
+}
+
+struct fm_device *fm_open(const char *path, enum fm_stream mode) {
+  struct fm_device *dev = calloc(1, sizeof(*dev));
+
+  if (!dev) {
+    return NULL;
+  }
+
+  dev->fd = fm_serial_open(path);
+  if (dev->fd < 0) {
+    free(dev);
+    return NULL;
+  }
+
+  dev->stop_fd = eventfd(0, EFD_CLOEXEC);
+  if ((dev->stop_fd < 0) || fm_select_stream(dev->fd, &dev->dec, mode)) {
+    fm_close(dev);
+    return NULL;
+  }
+
+  return dev;
+}
+
+/* Producer side of the queue, drops the reading when full. */
+static void fm_queue_push(const struct fm_reading *r, void *user) {
+  struct fm_device *dev  = user;
+  size_t            head = dev->head;
+
+  if (head - __atomic_load_n(&dev->tail, __ATOMIC_ACQUIRE) >= FM_QUEUE_SIZE) {
+    dev->queue_drops ++;
+    return;
+  }
+
+  dev->queue[head & (FM_QUEUE_SIZE - 1)] = *r;
+  __atomic_store_n(&dev->head, head + 1, __ATOMIC_RELEASE);
+}
+
+bool fm_pop(struct fm_device *dev, struct fm_reading *r) {
+  size_t tail = dev->tail;
+
+  if (tail == __atomic_load_n(&dev->head, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+
+  *r = dev->queue[tail & (FM_QUEUE_SIZE - 1)];
+  __atomic_store_n(&dev->tail, tail + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+static void *fm_reader(void *arg) {
+  struct fm_device *dev = arg;
+  struct pollfd fds[2] = {
+    {.fd = dev->fd,      .events = POLLIN},
+    {.fd = dev->stop_fd, .events = POLLIN},
+  };
+  fm_callback cb   = dev->cb ? dev->cb : fm_queue_push;
+  void       *user = dev->cb ? dev->user : dev;
+  ssize_t     len;
+
+  while (true) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (fds[1].revents) {
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      len = fm_decoder_read(&dev->dec, dev->fd, cb, user);
+      if ((len == 0) || ((len < 0) && (errno != EINTR))) {
+        break;
+      }
+    } else if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+      /* Unplugged. */
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+int fm_start(struct fm_device *dev, fm_callback cb, void *user) {
+  int ret;
+
+  dev->cb   = cb;
+  dev->user = user;
+
+  ret = pthread_create(&dev->thread, NULL, fm_reader, dev);
+  if (ret) {
+    errno = ret;
+    return -1;
+  }
+  dev->running = true;
+
+  return 0;
+}
+
+void fm_stop(struct fm_device *dev) {
+  uint64_t one = 1;
+
+  if (!dev->running) {
+    return;
+  }
+
+  if (write(dev->stop_fd, &one, sizeof(one)) == sizeof(one)) {
+    pthread_join(dev->thread, NULL);
+  }
+  dev->running = false;
+}
+
+void fm_close(struct fm_device *dev) {
+  if (!dev) {
+    return;
+  }
+
+  fm_stop(dev);
+  if (dev->stop_fd > 0) {
+    close(dev->stop_fd);
+  }
+  fm_serial_close(dev->fd);
+  free(dev);
+}
@@ -0,0 +1,102 @@
+#ifndef __LIBFREQMETER_H__
+#define __LIBFREQMETER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "../../protocol.h"
+
+#define FM_PATH_MAX    256
+#define FM_BUF_SIZE    65536
+#define FM_QUEUE_SIZE  4096 /* Readings, must be a power of 2. */
+
+/* Extra flags on top of PROTO_FLAG_*. */
+#define FM_FLAG_DOT    0x100 /* Text stream: activity indicator was shown. */
+
+enum fm_stream {
+  FM_STREAM_TEXT,   /* Device command 's'. */
+  FM_STREAM_BINARY, /* Device command 'b'. */
+};
+
+struct fm_reading {
+  uint64_t mhz;       /* Frequency in mHz.                                  */
+  uint32_t device_us; /* Gate close on the device clock, binary stream only. */
+  uint16_t seq;       /* Binary stream only.                                */
+  uint16_t lost;      /* Readings dropped right before this one, saturating. */
+  uint16_t flags;     /* PROTO_FLAG_* and FM_FLAG_*.                        */
+  int64_t  mono_ns;   /* Arrival time, CLOCK_MONOTONIC.                     */
+  int64_t  real_ns;   /* Arrival time, CLOCK_REALTIME.                      */
+};
+
+/*
+ * Called for every decoded reading. The reading is only valid during the call.
+ * Replies to the time probe 't' come this way too, flagged PROTO_FLAG_TIME, but only if one was sent.
+ */
+typedef void (*fm_callback)(const struct fm_reading *r, void *user);
+
+/*
+ * Stream decoder. Data is read straight into its buffer and decoded in place, so it can also be driven from
+ * an application's own poll()/epoll loop with fm_decoder_read().
+ */
+struct fm_decoder {
+  enum fm_stream mode;
+  bool           synced;   /* Text: first (partial) line skipped. Binary: seq of last record valid. */
+  uint16_t       seq;
+  size_t         start;
+  size_t         end;
+  uint64_t       readings;
+  uint64_t       errors;   /* Unparsable lines or corrupt records. */
+  uint64_t       lost;
+  uint8_t        buf[FM_BUF_SIZE];
+};
+
+/* Background reader, see fm_start(). */
+struct fm_device {
+  int               fd;
+  int               stop_fd;
+  pthread_t         thread;
+  bool              running;
+  fm_callback       cb;
+  void             *user;
+  struct fm_decoder dec;
+  /* Single-producer single-consumer queue, used when no callback is given. */
+  struct fm_reading queue[FM_QUEUE_SIZE];
+  size_t            head; /* Written by the reader thread only. */
+  size_t            tail; /* Written by the consumer only.      */
+  uint64_t          queue_drops;
+};
+
+/* Fills paths with stable names of attached meters (/dev/serial/by-id/...), returns how many were found. */
+int fm_discover(char paths[][FM_PATH_MAX], int max);
+
+/* Exclusive, raw open. Returns a file descriptor or a negative value with errno set. */
+int  fm_serial_open(const char *path);
+void fm_serial_close(int fd);
+/* Sends device commands in one write, e.g. "8001000u", which the device takes as a whole. */
+int  fm_send(int fd, const char *cmd);
+/* Selects the stream on the device and resets the decoder accordingly. */
+int  fm_select_stream(int fd, struct fm_decoder *dec, enum fm_stream mode);
+
+void fm_decoder_init(struct fm_decoder *dec, enum fm_stream mode);
+/* Decodes len bytes already placed at fm_decoder_space(). */
+void fm_decoder_feed(struct fm_decoder *dec, size_t len, fm_callback cb, void *user);
+uint8_t *fm_decoder_space(struct fm_decoder *dec, size_t *len);
+/* One read() into the decoder, then decode. Returns what read() returned, -1 with errno EINTR on a signal. */
+ssize_t fm_decoder_read(struct fm_decoder *dec, int fd, fm_callback cb, void *user);
+
+/* Parses a text stream line, "   8.014395 MHz . [Hold: OFF]". Returns false if it is not a reading. */
+bool fm_parse_line(const char *line, size_t len, struct fm_reading *r);
+
+/* Opens the device and selects the stream. Returns NULL with errno set on failure. */
+struct fm_device *fm_open(const char *path, enum fm_stream mode);
+/* Starts the reader thread. Readings go to cb if given, to the queue otherwise. */
+int  fm_start(struct fm_device *dev, fm_callback cb, void *user);
+/* Takes the oldest reading from the queue, false if empty. Only one consumer thread. */
+bool fm_pop(struct fm_device *dev, struct fm_reading *r);
+void fm_stop(struct fm_device *dev);
+void fm_close(struct fm_device *dev);
+
+#endif /* __LIBFREQMETER_H__ */
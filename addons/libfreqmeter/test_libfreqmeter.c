@@ -0,0 +1,322 @@
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/eventfd.h>
+
+#include "libfreqmeter.h"
+
+/*
+ * Host tests for the parts that need no device: the text line parser, both stream decoders, the reader
+ * queue and sending commands. Run with `make test`.
+ */
+
+#define MAX_READINGS 16
+#define BULK         100000 /* Records through the queue while it is being drained. */
+
+static int checks = 0;
+static int failed = 0;
+
+#define CHECK(cond, ...) do { \
+  checks ++; \
+  if (!(cond)) { \
+    failed ++; \
+    fprintf(stderr, "FAIL %s:%d: %s: ", __FILE__, __LINE__, #cond); \
+    fprintf(stderr, __VA_ARGS__); \
+    fprintf(stderr, "\n"); \
+  } \
+} while (0)
+
+/* Readings handed to the callback. */
+struct sink {
+  struct fm_reading r[MAX_READINGS];
+  int               n;
+};
+
+static void on_reading(const struct fm_reading *r, void *user) {
+  struct sink *s = user;
+
+  if (s->n < MAX_READINGS) {
+    s->r[s->n] = *r;
+  }
+  s->n ++;
+}
+
+static struct proto_record record(uint16_t seq, uint32_t hz, uint16_t mhz, uint8_t flags) {
+  struct proto_record rec = {
+    .sync    = PROTO_SYNC,
+    .flags   = flags,
+    .seq     = seq,
+    .time_us = 1000000 + seq,
+    .hz      = hz,
+    .mhz     = mhz,
+  };
+
+  rec.check = proto_check(&rec);
+  return rec;
+}
+
+static void feed(struct fm_decoder *dec, const void *data, size_t len, struct sink *s) {
+  size_t   space;
+  uint8_t *buf = fm_decoder_space(dec, &space);
+
+  memcpy(buf, data, len);
+  fm_decoder_feed(dec, len, on_reading, s);
+}
+
+static void test_parse(void) {
+  static const struct {
+    const char *line;
+    bool        ok;
+    uint64_t    mhz;
+    uint16_t    flags;
+  } cases[] = {
+    {"   8.014395 MHz . [Hold: OFF]",               true,  8014395000ULL,    FM_FLAG_DOT},
+    {"   8.014395 MHz   [Hold: ON ]",               true,  8014395000ULL,    PROTO_FLAG_HOLD},
+    {"   0.100000 MHz . [Hold: OFF] PRELIM",        true,  100000000ULL,     FM_FLAG_DOT | PROTO_FLAG_PRELIM},
+    {"   1.0000005 MHz   [Hold: OFF] BOTH",         true,  1000000500ULL,    PROTO_FLAG_BOTH},
+    {"   1.000000306 MHz . [Hold: ON ] FIT",        true,  1000000306ULL,    FM_FLAG_DOT | PROTO_FLAG_HOLD | PROTO_FLAG_FIT},
+    {"4294.967295 MHz   [Hold: OFF]",               true,  4294967295000ULL, 0},
+    {"   0.000000 MHz   [Hold: OFF]",               true,  0,                0},
+    /* Whole MHz, and decimals beyond mHz are cut off rather than rounded. */
+    {"  12 MHz   [Hold: OFF]",                      true,  12000000000ULL,   0},
+    {"   1.0000003069 MHz   [Hold: OFF]",           true,  1000000306ULL,    0},
+    /* Not readings. */
+    {"",                                            false, 0,                0},
+    {"     ",                                       false, 0,                0},
+    {"Clock output:       OFF",                     false, 0,                0},
+    {"   .5 MHz   [Hold: OFF]",                     false, 0,                0},
+    {"   8.014395 kHz . [Hold: OFF]",               false, 0,                0},
+    {"   8.014395 MHz",                             false, 0,                0},
+    {"   8.014395 MHz ",                            false, 0,                0},
+    {"   8.014395MHz . [Hold: OFF]",                false, 0,                0},
+    {"\033[1;1H   8.014395",                        false, 0,                0},
+  };
+  struct fm_reading r;
+  const char *line = "   8.014395 MHz . [Hold: ON ] PRELIM";
+  size_t i;
+
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i ++) {
+    bool ok = fm_parse_line(cases[i].line, strlen(cases[i].line), &r);
+
+    CHECK(ok == cases[i].ok, "\"%s\"", cases[i].line);
+    if (ok && cases[i].ok) {
+      CHECK(r.mhz == cases[i].mhz, "\"%s\": %" PRIu64 " mHz", cases[i].line, r.mhz);
+      CHECK(r.flags == cases[i].flags, "\"%s\": flags 0x%x", cases[i].line, r.flags);
+    }
+  }
+
+  /* Nothing past len is looked at. */
+  CHECK(fm_parse_line(line, strlen("   8.014395 MHz . [Hold: O"), &r), "short len");
+  CHECK(r.flags == FM_FLAG_DOT, "short len: flags 0x%x", r.flags);
+  CHECK(!fm_parse_line(line, strlen("   8.014395 MH"), &r), "cut in the unit");
+}
+
+static void test_text(void) {
+  static struct fm_decoder dec;
+  struct sink s = {.n = 0};
+  const char *part1 = "rtial line\r\n   8.000000 MHz . [Hold: OFF]\r\n   8.000";
+  const char *part2 = "001 MHz   [Hold: OFF]\r\nDigital Filter: OFF\r\n";
+
+  fm_decoder_init(&dec, FM_STREAM_TEXT);
+  feed(&dec, part1, strlen(part1), &s);
+  CHECK(s.n == 1, "%d readings after the first read", s.n);
+  feed(&dec, part2, strlen(part2), &s);
+  CHECK(s.n == 2, "%d readings", s.n);
+  CHECK(s.r[0].mhz == 8000000000ULL, "%" PRIu64, s.r[0].mhz);
+  CHECK(s.r[1].mhz == 8000001000ULL, "%" PRIu64, s.r[1].mhz);
+  CHECK(s.r[0].mono_ns != 0, "no arrival time");
+  CHECK(dec.readings == 2, "%" PRIu64, dec.readings);
+  CHECK(dec.errors == 1, "%" PRIu64 " errors", dec.errors);
+}
+
+static void test_binary(void) {
+  static struct fm_decoder dec;
+  struct proto_record rec[4];
+  struct sink s;
+  uint8_t     buf[sizeof(rec) + 3];
+
+  /* In sequence, mHz and flags passed through; the first record never counts as a gap. */
+  fm_decoder_init(&dec, FM_STREAM_BINARY);
+  s.n    = 0;
+  rec[0] = record(1234, 8000000, 0, 0);
+  rec[1] = record(1235, 1000000, 500, PROTO_FLAG_BOTH | PROTO_FLAG_HOLD);
+  feed(&dec, rec, 2 * sizeof(rec[0]), &s);
+  CHECK(s.n == 2, "%d readings", s.n);
+  CHECK((s.r[0].lost == 0) && (s.r[1].lost == 0), "lost %u %u", s.r[0].lost, s.r[1].lost);
+  CHECK(s.r[1].mhz == 1000000500ULL, "%" PRIu64, s.r[1].mhz);
+  CHECK(s.r[1].flags == (PROTO_FLAG_BOTH | PROTO_FLAG_HOLD), "flags 0x%x", s.r[1].flags);
+  CHECK((s.r[1].seq == 1235) && (s.r[1].device_us == 1001235), "seq %u time %u", s.r[1].seq, s.r[1].device_us);
+  CHECK(dec.errors == 0, "%" PRIu64 " errors", dec.errors);
+
+  /* Garbage before a record is skipped byte by byte. */
+  fm_decoder_init(&dec, FM_STREAM_BINARY);
+  s.n    = 0;
+  rec[0] = record(7, 10, 0, 0);
+  memcpy(buf, "OFF", 3);
+  memcpy(buf + 3, &rec[0], sizeof(rec[0]));
+  feed(&dec, buf, 3 + sizeof(rec[0]), &s);
+  CHECK(s.n == 1, "%d readings", s.n);
+  CHECK(dec.errors == 3, "%" PRIu64 " errors", dec.errors);
+
+  /* A corrupt record is dropped and the next one is found again. */
+  fm_decoder_init(&dec, FM_STREAM_BINARY);
+  s.n    = 0;
+  rec[0] = record(8, 20, 0, 0);
+  rec[1] = record(9, 30, 0, 0);
+  rec[0].check ^= 1;
+  feed(&dec, rec, 2 * sizeof(rec[0]), &s);
+  CHECK((s.n == 1) && (s.r[0].mhz == 30000), "%d readings", s.n);
+  CHECK(dec.errors == sizeof(rec[0]), "%" PRIu64 " errors", dec.errors);
+
+  /* Records split across reads. */
+  fm_decoder_init(&dec, FM_STREAM_BINARY);
+  s.n    = 0;
+  rec[0] = record(1, 40, 0, 0);
+  feed(&dec, &rec[0], 7, &s);
+  CHECK(s.n == 0, "%d readings from half a record", s.n);
+  feed(&dec, (uint8_t *)&rec[0] + 7, sizeof(rec[0]) - 7, &s);
+  CHECK(s.n == 1, "%d readings", s.n);
+
+  /* Gaps, also across the wrap of seq. */
+  fm_decoder_init(&dec, FM_STREAM_BINARY);
+  s.n    = 0;
+  rec[0] = record(100, 1, 0, 0);
+  rec[1] = record(103, 1, 0, 0);
+  rec[2] = record(65535, 1, 0, 0);
+  rec[3] = record(1, 1, 0, 0);
+  feed(&dec, rec, sizeof(rec), &s);
+  CHECK(s.n == 4, "%d readings", s.n);
+  CHECK(s.r[1].lost == 2, "lost %u", s.r[1].lost);
+  CHECK(s.r[2].lost == 65431, "lost %u", s.r[2].lost);
+  CHECK(s.r[3].lost == 1, "lost %u across the wrap", s.r[3].lost);
+  CHECK(dec.lost == 2 + 65431 + 1, "%" PRIu64 " lost", dec.lost);
+
+  /* A time probe reply does not consume a sequence number. */
+  fm_decoder_init(&dec, FM_STREAM_BINARY);
+  s.n    = 0;
+  rec[0] = record(5, 50, 0, 0);
+  rec[1] = record(6, 0, 0, PROTO_FLAG_TIME);
+  rec[2] = record(6, 60, 0, 0);
+  feed(&dec, rec, 3 * sizeof(rec[0]), &s);
+  CHECK(s.n == 3, "%d callbacks", s.n);
+  CHECK((s.r[1].flags & PROTO_FLAG_TIME) && (s.r[1].mhz == 0), "flags 0x%x", s.r[1].flags);
+  CHECK(s.r[1].device_us == 1000006, "time %u", s.r[1].device_us);
+  CHECK(s.r[2].lost == 0, "lost %u", s.r[2].lost);
+  CHECK(dec.readings == 2, "%" PRIu64 " readings", dec.readings);
+}
+
+/* A device whose port is the read end of a pipe. */
+static struct fm_device *pipe_device(int *wr) {
+  struct fm_device *dev = calloc(1, sizeof(*dev));
+  int fds[2];
+
+  if (!dev || pipe(fds)) {
+    perror("ERROR: pipe");
+    exit(1);
+  }
+  dev->fd      = fds[0];
+  dev->stop_fd = eventfd(0, EFD_CLOEXEC);
+  fm_decoder_init(&dev->dec, FM_STREAM_BINARY);
+  *wr = fds[1];
+
+  return dev;
+}
+
+static void write_records(int fd, uint32_t from, uint32_t n) {
+  struct proto_record rec;
+  uint32_t i;
+
+  for (i = from; i < from + n; i ++) {
+    rec = record(i, i, 0, 0);
+    if (write(fd, &rec, sizeof(rec)) != sizeof(rec)) {
+      perror("ERROR: write");
+      exit(1);
+    }
+  }
+}
+
+static void *writer_thread(void *arg) {
+  int fd = *(int *)arg;
+
+  write_records(fd, 0, BULK);
+  close(fd);
+  return NULL;
+}
+
+static void test_queue(void) {
+  struct fm_device *dev;
+  struct fm_reading r;
+  pthread_t writer;
+  uint32_t  n = 0, bad = 0, last = 0;
+  int       wr;
+
+  /* Overflow: without a consumer, the oldest FM_QUEUE_SIZE readings are kept and the rest counted. */
+  dev = pipe_device(&wr);
+  CHECK(!fm_pop(dev, &r), "pop from an empty queue");
+  CHECK(fm_start(dev, NULL, NULL) == 0, "fm_start: %s", strerror(errno));
+  write_records(wr, 0, FM_QUEUE_SIZE + 10);
+  close(wr);
+  pthread_join(dev->thread, NULL); /* Ends at end of file. */
+  dev->running = false;
+  while (fm_pop(dev, &r)) {
+    bad += (r.mhz != (uint64_t)n * 1000);
+    n ++;
+  }
+  CHECK(n == FM_QUEUE_SIZE, "%u popped", n);
+  CHECK(bad == 0, "%u out of order", bad);
+  CHECK(dev->queue_drops == 10, "%" PRIu64 " dropped", dev->queue_drops);
+  fm_close(dev);
+
+  /* Concurrent producer and consumer: nothing duplicated or reordered, and every reading popped or counted. */
+  dev = pipe_device(&wr);
+  CHECK(fm_start(dev, NULL, NULL) == 0, "fm_start: %s", strerror(errno));
+  pthread_create(&writer, NULL, writer_thread, &wr);
+  n   = 0;
+  bad = 0;
+  while (n + __atomic_load_n(&dev->queue_drops, __ATOMIC_ACQUIRE) < BULK) {
+    if (fm_pop(dev, &r)) {
+      bad += (r.mhz < (uint64_t)last * 1000);
+      last = r.mhz / 1000 + 1;
+      n ++;
+    }
+  }
+  pthread_join(writer, NULL);
+  CHECK(bad == 0, "%u out of order", bad);
+  CHECK(n + dev->queue_drops == BULK, "%u popped, %" PRIu64 " dropped", n, dev->queue_drops);
+  fm_close(dev);
+}
+
+/* A command and its argument go out in one write, which the device takes as one packet and keeps whole. */
+static void test_send(void) {
+  char    buf[64];
+  ssize_t len;
+  int     fds[2];
+
+  if (pipe(fds)) {
+    perror("ERROR: pipe");
+    exit(1);
+  }
+  CHECK(fm_send(fds[1], "8001000u") == 0, "fm_send: %s", strerror(errno));
+  CHECK(fm_send(fds[1], "-150c") == 0, "fm_send: %s", strerror(errno));
+  close(fds[1]);
+
+  len = read(fds[0], buf, sizeof(buf));
+  CHECK((len == 13) && !memcmp(buf, "8001000u-150c", 13), "%zd bytes", len);
+  close(fds[0]);
+}
+
+int main(int argc, char *argv[]) {
+  test_parse();
+  test_text();
+  test_binary();
+  test_queue();
+  test_send();
+
+  printf("%d checks, %d failed\n", checks, failed);
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,80 @@
+#include <stdbool.h>
+
+#include "alarm.h"
+#include "usbcdc.h"
+
+/*
+ * Alarms are reported to the host as CDC SERIAL_STATE notifications, so that supervision software can
+ * block in TIOCMIWAIT instead of parsing the screen:
+ *   DCD: signal present (cleared on loss of signal).
+ *   DSR: reading within limits.
+ *   RI:  rate-of-change alarm.
+ */
+
+static volatile uint32_t lower = 0;
+static volatile uint32_t upper = 0;
+static volatile uint32_t rate  = 0;
+static volatile uint8_t  state = 0;
+static uint32_t last_hz = 0;
+
+void alarm_set_lower(uint32_t hz) {
+  lower = hz;
+}
+
+void alarm_set_upper(uint32_t hz) {
+  upper = hz;
+}
+
+void alarm_set_rate(uint32_t hz) {
+  rate = hz;
+}
+
+uint32_t alarm_get_lower(void) {
+  return lower;
+}
+
+uint32_t alarm_get_upper(void) {
+  return upper;
+}
+
+uint32_t alarm_get_rate(void) {
+  return rate;
+}
+
+uint8_t alarm_get_state(void) {
+  return state;
+}
+
+void alarm_check(uint32_t hz) {
+  uint8_t  now = 0;
+  uint16_t lines;
+
+  if (hz == 0) {
+    now |= ALARM_LOS;
+  }
+  if ((lower && hz < lower) || (upper && hz > upper)) {
+    now |= ALARM_LIMIT;
+  }
+  /* No rate check across loss of signal, that one is already flagged. */
+  if (rate && hz && last_hz) {
+    if (((hz > last_hz) ? (hz - last_hz) : (last_hz - hz)) > rate) {
+      now |= ALARM_RATE;
+    }
+  }
+  last_hz = hz;
+
+  state = now;
+
+  lines = 0;
+  if (!(now & ALARM_LOS)) {
+    lines |= USBCDC_STATE_DCD;
+  }
+  if (!(now & ALARM_LIMIT)) {
+    lines |= USBCDC_STATE_DSR;
+  }
+  if (now & ALARM_RATE) {
+    lines |= USBCDC_STATE_RI;
+  }
+  /* Only sent when something changed. */
+  usbcdc_set_serial_state(lines);
+}
@@ -0,0 +1,23 @@
+#ifndef __STM32_FREQMETER_ALARM_H__
+#define __STM32_FREQMETER_ALARM_H__
+
+#include <stdint.h>
+
+/* Active alarm conditions, see alarm_get_state(). */
+#define ALARM_LOS   0x01 /* Loss of signal: nothing counted during the gate.  */
+#define ALARM_LIMIT 0x02 /* Reading outside [lower, upper].                   */
+#define ALARM_RATE  0x04 /* Change from the previous gate exceeds the limit.  */
+
+/* All limits in Hz, 0 disables the check. */
+void alarm_set_lower(uint32_t hz);
+void alarm_set_upper(uint32_t hz);
+void alarm_set_rate(uint32_t hz);
+uint32_t alarm_get_lower(void);
+uint32_t alarm_get_upper(void);
+uint32_t alarm_get_rate(void);
+
+/* Called from the gate ISR with every full-gate reading, including those taken while holding. */
+void alarm_check(uint32_t hz);
+uint8_t alarm_get_state(void);
+
+#endif /* __STM32_FREQMETER_ALARM_H__ */
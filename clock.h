@@ -0,0 +1,42 @@
+#ifndef __STM32_FREQMETER_CLOCK_H__
+#define __STM32_FREQMETER_CLOCK_H__
+
+/*
+ * Clock tree, from the crystal given to make (HSE_HZ) and the fixed 72MHz system clock.
+ * Everything that depends on it (SysTick reload, timestamps, filter cutoffs, clock output) is derived here,
+ * so that changing the crystal means changing the Makefile only.
+ */
+
+#ifndef HSE_HZ
+#define HSE_HZ    8000000
+#endif
+
+/* USB needs exactly 48MHz from the PLL divided by 1 or 1.5, and libopencm3 sets up 72MHz from these crystals. */
+#define SYSCLK_HZ 72000000
+
+#if HSE_HZ == 8000000
+#define CLOCK_SETUP() rcc_clock_setup_in_hse_8mhz_out_72mhz()
+#elif HSE_HZ == 12000000
+#define CLOCK_SETUP() rcc_clock_setup_in_hse_12mhz_out_72mhz()
+#elif HSE_HZ == 16000000
+#define CLOCK_SETUP() rcc_clock_setup_in_hse_16mhz_out_72mhz()
+#else
+#error "No clock setup for this HSE_HZ, supported crystals are 8, 12 and 16MHz."
+#endif
+
+#define HSI_HZ          8000000
+#define AHB_HZ          SYSCLK_HZ       /* AHB prescaler 1.                                   */
+#define APB1_HZ         (AHB_HZ / 2)    /* APB1 prescaler 2, at most 36MHz.                   */
+#define TIM2_HZ         (APB1_HZ * 2)   /* Timers on APB1 run at twice APB1 when prescaled.   */
+#define MCO_PLL_HZ      (SYSCLK_HZ / 2) /* MCO "PLL / 2".                                     */
+
+/* SysTick runs from AHB and interrupts every millisecond. */
+#define SYSTICK_RELOAD  (AHB_HZ / 1000)
+#define TICKS_PER_US    (AHB_HZ / 1000000)
+
+_Static_assert(APB1_HZ <= 36000000, "APB1 above 36MHz");
+_Static_assert(SYSTICK_RELOAD <= 0x1000000, "SysTick reload is 24 bits");
+_Static_assert(AHB_HZ % 1000000 == 0, "timestamps need whole ticks per microsecond");
+_Static_assert(MCO_PLL_HZ <= 50000000, "MCO pin is specified up to 50MHz");
+
+#endif /* __STM32_FREQMETER_CLOCK_H__ */
@@ -0,0 +1,127 @@
+#include <stddef.h>
+
+#include <libopencm3/stm32/flash.h>
+
+#include "config.h"
+
+/*
+ * Wear-levelled configuration store in the last two flash pages (see stm32f103x8.ld).
+ *
+ * Records are appended to the first erased slot. When the active page is full, the other one is erased and
+ * writing continues there. A page holds CONFIG_SLOTS (64) records, so each page is erased once every
+ * 2 * CONFIG_SLOTS (128) saves. The newest record is the valid one with the highest sequence number.
+ */
+
+#define CONFIG_MAGIC 0xc0f1
+#define PAGE_SIZE    1024
+#define CONFIG_SLOTS (PAGE_SIZE / sizeof(struct config_record))
+
+struct config_record {
+  uint16_t magic;    /* 0xffff marks an erased slot. */
+  uint16_t seq;
+  uint8_t  mco;
+  uint8_t  filter;
+  uint8_t  prescaler;
+  uint8_t  gate;
+  int32_t  cal_ppb;
+  uint8_t  flags;
+  uint8_t  reserved;
+  uint16_t check;    /* Inverted sum of all other half-words. */
+};
+
+/* From the linker script. */
+extern struct config_record _config_start[], _config_end[];
+
+static uint16_t config_check(const struct config_record *rec) {
+  const uint16_t *hw = (const uint16_t *)rec;
+  uint16_t sum = 0;
+  size_t   i;
+
+  for (i = 0; i < offsetof(struct config_record, check) / 2; i ++) {
+    sum += hw[i];
+  }
+
+  return ~sum;
+}
+
+static bool config_valid(const struct config_record *rec) {
+  return (rec->magic == CONFIG_MAGIC) && (rec->check == config_check(rec));
+}
+
+static const struct config_record *config_latest(void) {
+  const struct config_record *rec, *latest = NULL;
+
+  for (rec = _config_start; rec < _config_end; rec ++) {
+    if (!config_valid(rec)) {
+      continue;
+    }
+    /* Serial number arithmetic, both pages together hold far less than 32768 records. */
+    if (!latest || (int16_t)(rec->seq - latest->seq) > 0) {
+      latest = rec;
+    }
+  }
+
+  return latest;
+}
+
+bool config_load(struct config *cfg) {
+  const struct config_record *rec = config_latest();
+
+  if (!rec) {
+    return false;
+  }
+
+  cfg->mco       = rec->mco;
+  cfg->filter    = rec->filter;
+  cfg->prescaler = rec->prescaler;
+  cfg->gate      = rec->gate;
+  cfg->flags     = rec->flags;
+  cfg->cal_ppb   = rec->cal_ppb;
+
+  return true;
+}
+
+bool config_save(const struct config *cfg) {
+  const struct config_record *latest = config_latest();
+  struct config_record *slot;
+  struct config_record rec = {
+    .magic     = CONFIG_MAGIC,
+    .seq       = latest ? latest->seq + 1 : 0,
+    .mco       = cfg->mco,
+    .filter    = cfg->filter,
+    .prescaler = cfg->prescaler,
+    .gate      = cfg->gate,
+    .cal_ppb   = cfg->cal_ppb,
+    .flags     = cfg->flags,
+    .reserved  = 0xff,
+  };
+  const uint16_t *hw = (const uint16_t *)&rec;
+  size_t i;
+
+  rec.check = config_check(&rec);
+
+  /* Next slot after the newest record, wrapping around both pages. */
+  slot = latest ? (struct config_record *)latest + 1 : _config_start;
+  if (slot >= _config_end) {
+    slot = _config_start;
+  }
+  if ((slot->magic != 0xffff) && ((uint32_t)slot % PAGE_SIZE)) {
+    /* Half-written slot left by a power loss, continue on the other page. */
+    slot = (slot < _config_start + CONFIG_SLOTS) ? _config_start + CONFIG_SLOTS : _config_start;
+  }
+
+  flash_unlock();
+
+  if (((uint32_t)slot % PAGE_SIZE) == 0) {
+    /* Entering a page, which still holds records from its previous round. */
+    flash_erase_page((uint32_t)slot);
+  }
+
+  for (i = 0; i < sizeof(rec) / 2; i ++) {
+    flash_program_half_word((uint32_t)slot + i * 2, hw[i]);
+  }
+
+  flash_lock();
+
+  return config_valid(slot) && (slot->seq == rec.seq);
+}
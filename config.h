@@ -0,0 +1,29 @@
+#ifndef __STM32_FREQMETER_CONFIG_H__
+#define __STM32_FREQMETER_CONFIG_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* config.flags */
+#define CONFIG_HOLD   0x01
+#define CONFIG_STREAM 0x02
+#define CONFIG_BINARY 0x04
+#define CONFIG_BOTH   0x08 /* Count both edges. */
+#define CONFIG_FIT    0x10 /* Least-squares estimator. */
+
+/* Indexes refer to the option tables in ui.h. */
+struct config {
+  uint8_t mco;
+  uint8_t filter;
+  uint8_t prescaler;
+  uint8_t gate;
+  uint8_t flags;
+  int32_t cal_ppb;   /* Added to every reading, in parts per billion. */
+};
+
+/* Returns false if nothing valid has been stored. */
+bool config_load(struct config *cfg);
+/* Stalls the CPU (and interrupts) for up to ~40ms when a page has to be erased. */
+bool config_save(const struct config *cfg);
+
+#endif /* __STM32_FREQMETER_CONFIG_H__ */
@@ -1,52 +1,63 @@
-#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/dwt.h>
 #include <libopencm3/usb/usbd.h>
 
 #include "usbcdc.h"
+#include "stats.h"
+#include "alarm.h"
+#include "config.h"
+#include "protocol.h"
+#include "clock.h"
+#include "ui.h"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
 #define PACKET_SIZE 64
-#define BUFFER_SIZE 256
-#define DISP_DELAY  100
+#define REC_RING    64   /* Binary records waiting to be sent. */
+#define PRELIM_MS   100  /* First gate after power-up, so that a reading is ready by the time USB is. */
+#define TEST_GATE   2    /* Self-test: index into gates_ms for the filter and prescaler sweep, 10 ms. */
+#define HSI_TOL_PPM 25000 /* Self-test: datasheet accuracy of the RC oscillator over temperature. */
 
-/* NOTE: For systems that has SYSCLK != 72MHz, modify mco_val, mco_name and filters_name in addition to clock setup. */
+/* NOTE: Clock-dependent constants come from clock.h, set HSE_HZ in the Makefile for other crystals. */
 
 static volatile uint32_t systick_ms   = 0;
-static volatile uint32_t freq         = 0; /* 32bit = approx. 4.3G ticks per second. */
+static volatile uint32_t freq         = 0; /* Hz. 32bit = approx. 4.3G ticks per second. */
+static volatile uint16_t freq_mhz     = 0; /* Fraction of freq in 1/1000 Hz, see count_name and estimator_name. */
 static volatile uint32_t freq_scratch = 0; /* scratch pad. */
-static volatile bool     hold         = false;
-
-static uint32_t mco_val[] = {
-  RCC_CFGR_MCO_NOCLK,
-  //RCC_CFGR_MCO_SYSCLK,       /* Will not be able to output. */
-  RCC_CFGR_MCO_HSI,
-  RCC_CFGR_MCO_HSE,
-  RCC_CFGR_MCO_PLL_DIV2,
-  //RCC_CFGR_MCO_PLL2CLK,      /* No signal. */
-  //RCC_CFGR_MCO_PLL3CLK_DIV2, /* No signal. */
-  //RCC_CFGR_MCO_XT1,          /* No signal. */
-  //RCC_CFGR_MCO_PLL3,         /* No signal. */
+static volatile bool     freq_prelim  = false; /* freq comes from the short first gate. */
+static volatile uint32_t gate_seq     = 0; /* Incremented on every finished gate. */
+static volatile uint32_t gate_ms      = PRELIM_MS; /* Length of the running gate. */
+static volatile uint32_t gate_elapsed = 0;
+static volatile uint32_t isr_cycles   = 0; /* Spent in the counting ISRs during the running gate. */
+static volatile uint32_t gate_cycles  = 0; /* Same, for the last finished gate. */
+
+/* Running sums of the least-squares fit over the running gate, time centered on the middle of the gate. */
+static volatile uint32_t fit_t0       = 0; /* Cycle counter at gate start. */
+static volatile uint32_t fit_n        = 0;
+static volatile int64_t  fit_st       = 0;
+static volatile int64_t  fit_sc       = 0;
+static volatile int64_t  fit_stt      = 0;
+static volatile int64_t  fit_stc      = 0;
+_Static_assert((uint64_t)FIT_HZ * ((uint64_t)AHB_HZ * AHB_HZ / 12) < (1ULL << 62), "fit sums overflow on a 1s gate");
+_Static_assert(TIM2_HZ % FIT_HZ == 0, "FIT_HZ must divide the timer clock");
+
+/* SYSCLK will not be able to output, PLL2CLK, PLL3CLK_DIV2, XT1 and PLL3 give no signal. */
+static const uint32_t mco_val[MCO_COUNT] = {
+  [MCO_OFF]      = RCC_CFGR_MCO_NOCLK,
+  [MCO_HSI]      = RCC_CFGR_MCO_HSI,
+  [MCO_HSE]      = RCC_CFGR_MCO_HSE,
+  [MCO_PLL_DIV2] = RCC_CFGR_MCO_PLL_DIV2,
 };
-static char *mco_name[] = {
-  "      OFF",
-  //"72 MHz   ", /* Will not be able to output. */
-  " 8 MHz RC",
-  " 8 MHz   ",
-  "36 MHz   ",
-  //"PLL2     ", /* No signal. */
-  //"PLL3 DIV2", /* No signal. */
-  //"XT1      ", /* No signal. */
-  //"PLL3     ", /* No signal. */
-};
-static int mco_current = 0; /* Default to off. */
 
 static enum tim_ic_filter filters_val[] = {
   TIM_IC_OFF,
@@ -72,31 +83,7 @@ static enum tim_ic_filter filters_val[] = {
   TIM_IC_DTF_DIV_32_N_6,
   TIM_IC_DTF_DIV_32_N_8,
 };
-static char *filters_name[] = {
-  "       OFF",
-
-  "36.000 MHz",
-  "18.000 MHz",
-  " 9.000 MHz",
-
-  " 6.000 MHz",
-  " 4.500 MHz",
-
-  " 3.000 MHz",
-  " 2.250 MHz",
-
-  " 1.500 MHz",
-  " 1.125 MHz",
-
-  "900.00 kHz",
-  "750.00 kHz",
-  "562.50 kHz",
-
-  "450.00 kHz",
-  "375.00 kHz",
-  "281.25 kHz",
-};
-static int filter_current = 0; /* Default to no filter. */
+_Static_assert(ARRAY_SIZE(filters_val) == FILTER_COUNT, "filters_val does not match filters_hz");
 
 static enum tim_ic_psc prescalers_val[] = {
   TIM_IC_PSC_OFF,
@@ -105,25 +92,46 @@ static enum tim_ic_psc prescalers_val[] = {
   TIM_IC_PSC_4,
   TIM_IC_PSC_8,
 };
-static char *prescalers_name[] = {
-  "OFF",
-
-  "  2",
-  "  4",
-  "  8",
-};
-static int prescaler_current = 0; /* Default to no prescaler. */
-
-static char buffer[BUFFER_SIZE];
+_Static_assert(ARRAY_SIZE(prescalers_val) == PRESCALER_COUNT, "prescalers_val does not match prescalers_name");
 
 void systick_ms_setup(void) {
-  /* 72MHz clock, interrupt for every 72,000 CLKs (1ms). */
+  /* AHB clock, interrupt every millisecond. */
   systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
-  systick_set_reload(72000 - 1);
+  systick_set_reload(SYSTICK_RELOAD - 1);
   systick_interrupt_enable();
   systick_counter_enable();
 }
 
+/* Device clock in us, wraps every ~71 minutes. Also correct with interrupts masked. */
+static uint32_t device_us(void) {
+  uint32_t ms    = systick_ms;
+  uint32_t ticks = SYSTICK_RELOAD - 1 - systick_get_value();
+
+  if (SCB_ICSR & SCB_ICSR_PENDSTSET) {
+    /* Wrapped, but sys_tick_handler() has not run yet. */
+    ms ++;
+    ticks = SYSTICK_RELOAD - 1 - systick_get_value();
+  }
+
+  return ms * 1000 + ticks / TICKS_PER_US;
+}
+
+/* Filter and prescaler. The filter is set for both the ETR and the TI1 path. */
+void input_apply(void) {
+  timer_slave_set_filter(TIM2, filters_val[filter_current]);
+  timer_ic_set_filter(TIM2, TIM_IC1, filters_val[filter_current]);
+  timer_slave_set_prescaler(TIM2, prescalers_val[prescaler_current]);
+}
+
+/* The sampler only runs, and takes ISR time, while fitting. */
+void estimator_apply(void) {
+  if (estimator_current == EST_FIT) {
+    timer_enable_counter(TIM3);
+  } else {
+    timer_disable_counter(TIM3);
+  }
+}
+
 void timer_setup(void) {
   /* NOTE: Digital input pins have Schmitt filter. */
 
@@ -142,127 +150,419 @@ void timer_setup(void) {
   timer_disable_oc_output(TIM2, TIM_OC3);
   timer_disable_oc_output(TIM2, TIM_OC4);
 
+  /* Channel 1 feeds TI1F_ED for counting both edges, so overflows are flagged by compare channel 2. */
+  timer_ic_set_input(TIM2, TIM_IC1, TIM_IC_IN_TI1);
+
   /* Timer mode: no divider, edge, count up */
   timer_disable_preload(TIM2);
   timer_continuous_mode(TIM2);
   timer_set_period(TIM2, 65535);
   timer_slave_set_mode(TIM2, TIM_SMCR_SMS_ECM1);
-  timer_slave_set_filter(TIM2, filters_val[filter_current]);
   timer_slave_set_polarity(TIM2, TIM_ET_RISING);
-  timer_slave_set_prescaler(TIM2, prescalers_val[prescaler_current]);
-  timer_slave_set_trigger(TIM2, TIM_SMCR_TS_ETRF);
+  timer_slave_set_trigger(TIM2, (count_current == COUNT_BOTH) ? TIM_SMCR_TS_TI1F_ED : TIM_SMCR_TS_ETRF);
+  input_apply();
   timer_update_on_overflow(TIM2);
 
   nvic_enable_irq(NVIC_TIM2_IRQ);
   timer_enable_counter(TIM2);
-  timer_enable_irq(TIM2, TIM_DIER_CC1IE);
+  timer_enable_irq(TIM2, TIM_DIER_CC2IE);
+
+  /* TIM3 (also on APB1) samples the count for the least-squares estimator. */
+  rcc_periph_clock_enable(RCC_TIM3);
+  rcc_periph_reset_pulse(RST_TIM3);
+  timer_set_prescaler(TIM3, 0);
+  timer_set_period(TIM3, TIM2_HZ / FIT_HZ - 1);
+  timer_enable_irq(TIM3, TIM_DIER_UIE);
+  nvic_enable_irq(NVIC_TIM3_IRQ);
+  estimator_apply();
+}
+
+void gate_start(void) {
+  /* Reset the counter. This will generate one extra overflow for next measurement. */
+  /* In case of nothing got counted, manually generate a reset to keep consistency. */
+  timer_set_counter(TIM2, 1);
+  timer_set_counter(TIM2, 0);
+  freq_scratch = 0;
+  gate_elapsed = 0;
+
+  fit_t0  = dwt_read_cycle_counter();
+  fit_n   = 0;
+  fit_st  = 0;
+  fit_sc  = 0;
+  fit_stt = 0;
+  fit_stc = 0;
+}
+
+/* Count since gate start, plus the extra overflow. Also correct with an overflow pending, as device_us(). */
+static uint32_t gate_count(void) {
+  uint32_t cnt = timer_get_counter(TIM2);
+
+  if (timer_get_flag(TIM2, TIM_SR_CC2IF)) {
+    return freq_scratch + 65536 + timer_get_counter(TIM2);
+  }
+
+  return freq_scratch + cnt;
+}
+
+/* Slope of the fit in counts per second, as mHz. False if there is nothing to fit. */
+static bool fit_read(uint64_t *mhz) {
+  int64_t  n = fit_n;
+  int64_t  num, den;
+  uint64_t rem, frac = 0, q;
+  int      i;
+
+  if (n < 3) {
+    return false;
+  }
+
+  /* Sum of squares over the mean; the products stay within 64 bits because time is centered. */
+  num = fit_stc - fit_st * (fit_sc / n) - fit_st * (fit_sc % n) / n;
+  den = fit_stt - fit_st * fit_st / n;
+  if ((num < 0) || (den <= 0) || (num >= den)) {
+    /* Not below one count per cycle. */
+    return false;
+  }
+
+  /* Counts per cycle as a 36-bit binary fraction, by long division since num << 36 does not fit. */
+  rem = num;
+  for (i = 0; i < 36; i ++) {
+    rem  <<= 1;
+    frac <<= 1;
+    if (rem >= (uint64_t)den) {
+      rem  -= den;
+      frac |= 1;
+    }
+  }
+
+  q    = frac * AHB_HZ; /* Hz in Q36, below 2^63. */
+  *mhz = (q >> 36) * 1000 + (((q & ((1ULL << 36) - 1)) * 1000) >> 36);
+
+  return true;
+}
+
+void gate_set(uint32_t ms) {
+  CM_ATOMIC_BLOCK() {
+    gate_ms = ms;
+    gate_start();
+  }
+}
+
+void count_apply(void) {
+  /* The trigger may only change while the slave mode is off, during which the counter runs on the internal clock. */
+  CM_ATOMIC_BLOCK() {
+    timer_slave_set_mode(TIM2, TIM_SMCR_SMS_OFF);
+    timer_slave_set_trigger(TIM2, (count_current == COUNT_BOTH) ? TIM_SMCR_TS_TI1F_ED : TIM_SMCR_TS_ETRF);
+    timer_slave_set_mode(TIM2, TIM_SMCR_SMS_ECM1);
+    gate_start();
+  }
 }
 
 void mco_setup(void) {
-  /* Outputs 36MHz clock on PA8, for calibration. */
+  /* Outputs the selected clock on PA8, for calibration. */
   gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO8);
   rcc_set_mco(mco_val[mco_current]); /* This merely sets RCC_CFGR. */
 }
 
-void usbcdc_printf(const char *fmt, ...) {
-  int len;
-  uint16_t written = 0;
-  va_list args;
-  va_start(args, fmt);
-
-  /* TODO: The following line costs approx. 20KB. Find an alternative if necessary. */
-  len = vsnprintf(
-    buffer,
-    BUFFER_SIZE,
-    fmt,
-    args
-  );
+/* Filled by the gate ISR in binary mode, drained by the main loop. */
+static struct proto_record rec_ring[REC_RING];
+static volatile uint32_t   rec_head = 0;
+static volatile uint32_t   rec_tail = 0;
+static uint16_t            rec_seq  = 0;
+
+bool ui_write(const char *text, size_t len) {
+  size_t written = 0;
+
   while (written < len) {
     if ((len - written) > PACKET_SIZE) {
-      written += usbcdc_write(buffer + written, PACKET_SIZE);
+      written += usbcdc_write(text + written, PACKET_SIZE);
     } else {
-      written += usbcdc_write(buffer + written, len - written);
+      written += usbcdc_write(text + written, len - written);
     }
   }
+
+  return true;
 }
 
-void usbcdc_clear_screen(void) {
-  usbcdc_printf("\033c\r");
+void ui_apply(unsigned what) {
+  if (what & UI_APPLY_MCO) {
+    rcc_set_mco(mco_val[mco_current]);
+  }
+  if (what & UI_APPLY_INPUT) {
+    input_apply();
+  }
+  if (what & UI_APPLY_COUNT) {
+    count_apply();
+  }
+  if (what & UI_APPLY_ESTIMATOR) {
+    estimator_apply();
+  }
+  if (what & UI_APPLY_GATE) {
+    gate_set(gates_ms[gate_current]);
+  }
+  if ((what & UI_APPLY_OUTPUT) && (output == OUTPUT_BINARY)) {
+    /* Nothing from before the switch. */
+    rec_tail = rec_head;
+  }
 }
 
-void poll_command(void) {
-  char cmd = usbcdc_getc();
+/* The reading of the last finished gate, as shown. */
+static void reading_get(struct ui_reading *r) {
+  r->hz     = freq;
+  r->mhz    = freq_mhz;
+  r->prelim = freq_prelim;
+  r->dot    = gpio_get(GPIOB, GPIO1);
+}
 
-  switch (cmd) {
-    case '\0': {
-      /* No input available. */
-      return;
-    }
+void stream_records(void) {
+  struct proto_record pkt[PACKET_SIZE / sizeof(struct proto_record)];
+  uint16_t written = 0;
+  int n = 0;
 
-    case 'o':
-    case 'O': {
-      /* Switch MCO. */
-      mco_current ++;
-      if (mco_current >= ARRAY_SIZE(mco_val)) {
-        mco_current = 0;
-      }
+  while ((n < ARRAY_SIZE(pkt)) && (rec_tail != rec_head)) {
+    pkt[n ++] = rec_ring[rec_tail];
+    rec_tail = (rec_tail + 1) % REC_RING;
+  }
 
-      rcc_set_mco(mco_val[mco_current]);
+  while (written < n * sizeof(struct proto_record)) {
+    written += usbcdc_write((char *)pkt + written, n * sizeof(struct proto_record) - written);
+  }
+}
 
-      return;
+/* Time probe for the host to estimate the clock offset, queued with the readings. */
+void stream_time(void) {
+  struct proto_record *rec;
+  uint32_t next;
+
+  CM_ATOMIC_BLOCK() {
+    next = (rec_head + 1) % REC_RING;
+    if (next != rec_tail) {
+      rec = &rec_ring[rec_head];
+      rec->sync    = PROTO_SYNC;
+      rec->flags   = PROTO_FLAG_TIME;
+      rec->seq     = rec_seq;
+      rec->time_us = device_us();
+      rec->hz      = 0;
+      rec->mhz     = 0;
+      rec->check   = proto_check(rec);
+      rec_head = next;
     }
+  }
+}
 
-    case 'h':
-    case 'H': {
-      /* Toggle hold. */
-      hold = !hold;
+/* Loopback self-test, with PA8 wired to PA0: every clock output is counted with every setup. */
 
-      return;
+/* One full gate of the running setup, in step with SysTick. Returns Hz, load is in 0.01%. */
+static uint32_t test_gate(int gate, uint16_t *mhz, uint32_t *load) {
+  uint32_t seq;
+
+  CM_ATOMIC_BLOCK() {
+    gate_current = gate;
+    gate_ms      = 1; /* Closes at the next tick, the measured gate then starts right on one. */
+    gate_start();
+    seq          = gate_seq;
+  }
+  while ((gate_seq - seq) < 2);
+
+  /* Exception entry and exit, a few dozen cycles per interrupt, are not included. */
+  *load = (uint64_t)gate_cycles * 10000 / ((uint64_t)gates_ms[gate] * (AHB_HZ / 1000));
+  *mhz  = freq_mhz;
+
+  return freq;
+}
+
+/* Prints one line of the table, returns true if the reading is within tolerance. */
+static bool test_line(int gate) {
+  char     mco[UI_FIELD_SIZE], filter[UI_FIELD_SIZE];
+  uint32_t expected = mco_hz[mco_current];
+  uint32_t hz, load, diff, tol;
+  uint16_t mhz;
+  int64_t  err;
+  bool     ok;
+
+  hz   = test_gate(gate, &mhz, &load);
+  diff = (hz > expected) ? (hz - expected) : (expected - hz);
+  err  = ((int64_t)hz * 1000 + mhz - (int64_t)expected * 1000) * 1000000 / expected; /* ppb */
+  if (err > 999999999) {
+    err = 999999999;
+  } else if (err < -999999999) {
+    err = -999999999;
+  }
+
+  /* One count either way, the known sub-ppm loss, and the trim of the RC oscillator. */
+  tol = (1 << prescaler_current) * (1000 / gates_ms[gate]) + expected / 1000000;
+  if (mco_current == MCO_HSI) {
+    tol += (uint64_t)expected * HSI_TOL_PPM / 1000000;
+  }
+  ok = (diff <= tol);
+
+  ui_mco_text(mco, mco_current);
+  ui_hz_text(filter, filters_hz[filter_current]);
+  ui_printf("%s  %s  %s  %s%-4s  %4lu ms  %10lu.%03u  %+10ld  %3lu.%02lu%%  %s\r\n",
+    mco,
+    filter,
+    prescalers_name[prescaler_current],
+    (count_current == COUNT_BOTH) ? "both" : "rise",
+    (estimator_current == EST_FIT) ? "+fit" : "",
+    gates_ms[gate],
+    hz,
+    mhz,
+    (int32_t)err,
+    load / 100,
+    load % 100,
+    ok ? "ok" : "FAIL"
+  );
+
+  return ok;
+}
+
+/* Blocks until done and a key is pressed, then restores the setup. all_gates takes ~5 minutes. */
+void test_run(bool all_gates) {
+  /* Index into mco_val, by filter and by prescaler, the last column is for both edges. */
+  static uint8_t best[FILTER_COUNT][PRESCALER_COUNT + 1];
+  struct config saved;
+  char text[UI_FIELD_SIZE];
+  int  first = all_gates ? 0 : TEST_GATE;
+  int  last  = all_gates ? GATE_COUNT - 1 : TEST_GATE;
+  int  m, c, e, f, p, g, col;
+  bool ok;
+
+  config_collect(&saved);
+  hold              = false;
+  cal_ppb           = 0;
+  output            = OUTPUT_TEXT; /* Keeps the gate ISR from queueing records. */
+  estimator_current = EST_COUNTER;
+  estimator_apply();
+  memset(best, 0, sizeof(best));
+
+  ui_printf("\033[H\033[2J\033[?25h");
+  ui_printf("Self-test, PA8 (clock output) must be wired to PA0 (input).\r\n\r\n");
+  ui_printf("%-9s  %-10s  %s  %-8s  %-7s  %14s  %10s  %7s\r\n",
+    "Clock", "Filter", "Psc", "Mode", "Gate", "Hz", "Error ppb", "ISR"
+  );
+
+  for (m = 1; m < MCO_COUNT; m ++) {
+    mco_current = m;
+    rcc_set_mco(mco_val[m]);
+
+    for (c = 0; c < COUNT_MODES; c ++) {
+      count_current = c;
+      count_apply();
+
+      for (f = 0; f < FILTER_COUNT; f ++) {
+        /* The prescaler is not in the path for both edges. */
+        for (p = 0; p < ((c == COUNT_BOTH) ? 1 : PRESCALER_COUNT); p ++) {
+          filter_current    = f;
+          prescaler_current = p;
+          input_apply();
+
+          ok = true;
+          for (g = first; g <= last; g ++) {
+            ok = test_line(g) && ok;
+          }
+          col = (c == COUNT_BOTH) ? PRESCALER_COUNT : p;
+          if (ok && (mco_hz[m] > mco_hz[best[f][col]])) {
+            best[f][col] = m;
+          }
+        }
+      }
+
+      /* Unfiltered: the other gates with the counter, every gate with the least-squares estimator. */
+      filter_current    = 0;
+      prescaler_current = 0;
+      input_apply();
+      for (e = 0; e < ESTIMATORS; e ++) {
+        estimator_current = e;
+        estimator_apply();
+        for (g = 0; g < GATE_COUNT; g ++) {
+          if ((e == EST_FIT) || (!all_gates && (g != TEST_GATE))) {
+            test_line(g);
+          }
+        }
+      }
+      estimator_current = EST_COUNTER;
+      estimator_apply();
     }
+  }
 
-    case 'f':
-    case 'F': {
-      /* Configure digital filter. */
-      filter_current ++;
-      if (filter_current >= ARRAY_SIZE(filters_val)) {
-        filter_current = 0;
+  ui_printf("\r\nHighest clock output counted correctly:\r\n\r\n%-10s", "Filter");
+  for (col = 0; col <= PRESCALER_COUNT; col ++) {
+    if (col < PRESCALER_COUNT) {
+      snprintf(text, UI_FIELD_SIZE, "Psc %s", prescalers_name[col]);
+    } else {
+      snprintf(text, UI_FIELD_SIZE, "Both");
+    }
+    ui_printf("  %9s", text);
+  }
+  for (f = 0; f < FILTER_COUNT; f ++) {
+    ui_hz_text(text, filters_hz[f]);
+    ui_printf("\r\n%s", text);
+    for (col = 0; col <= PRESCALER_COUNT; col ++) {
+      if (best[f][col]) {
+        ui_mco_text(text, best[f][col]);
+      } else {
+        snprintf(text, UI_FIELD_SIZE, "%9s", "none");
       }
+      ui_printf("  %s", text);
+    }
+  }
+  ui_printf("\r\n\r\nPress any key to return.\r\n");
+  while (usbcdc_getc() == '\0');
 
-      timer_slave_set_filter(TIM2, filters_val[filter_current]);
+  config_apply(&saved);
+}
 
-      return;
+/* Returns true if the screen needs updating. */
+bool poll_command(void) {
+  char cmd;
+  uint32_t arg;
+
+  if (!usbcdc_has_input()) {
+    /* No input available. */
+    return false;
+  }
+  cmd = usbcdc_getc();
+
+  switch (ui_command(&cmd, &arg)) {
+    case UI_IDLE: {
+      return false;
     }
 
-    case 'p':
-    case 'P': {
-      /* Configure prescaler. */
-      prescaler_current ++;
-      if (prescaler_current >= ARRAY_SIZE(prescalers_val)) {
-        prescaler_current = 0;
-      }
+    case UI_UPDATE: {
+      return true;
+    }
 
-      timer_slave_set_prescaler(TIM2, prescalers_val[prescaler_current]);
+    case UI_OTHER: {
+      break;
+    }
+  }
 
-      return;
+  switch (cmd) {
+    case 't': {
+      /* Binary stream only: reply with the device clock, see stream_time(). */
+      if (output == OUTPUT_BINARY) {
+        stream_time();
+      }
+
+      return false;
     }
 
-    case '\n':
-    case '\r': {
-      /* Remote echo for newline -- for convenient data recording. */
-      usbcdc_write("\r\n", 1); /* This works since buffer is not modified. */
+    case 'x': {
+      /* Loopback self-test, "1x" to also run every setup with every gate. */
+      test_run(arg != 0);
+      ui_enter();
 
-      return;
+      return true;
     }
 
     default: {
       /* Invalid command. */
-      return;
+      return false;
     }
   }
 }
 
 int main(void) {
-  rcc_clock_setup_in_hse_8mhz_out_72mhz();
+  CLOCK_SETUP();
   rcc_periph_clock_enable(RCC_GPIOA); /* For MCO. */
   rcc_periph_clock_enable(RCC_GPIOB); /* For LED, USB pull-up and TIM2. */
   rcc_periph_clock_enable(RCC_AFIO); /* For MCO. */
@@ -283,45 +583,64 @@ int main(void) {
 
   gpio_clear(GPIOB, GPIO1);
 
+  dwt_enable_cycle_counter(); /* For the least-squares estimator, and the ISR load in the self-test. */
   timer_setup();
+
+  /* Restore the saved setup, if any, once the timers take it but before anything is measured. */
+  struct config cfg;
+  if (config_load(&cfg)) {
+    config_apply(&cfg);
+  }
+  gate_set((gates_ms[gate_current] > PRELIM_MS) ? PRELIM_MS : gates_ms[gate_current]);
   systick_ms_setup();
   mco_setup();
 
-  /* Wait 500ms for USB setup to complete before trying to send anything. */
-  /* Takes ~ 130ms on my machine */
-  // TODO: a better way?
-  while (systick_ms < 500);
+  /* Wait for USB setup to complete before trying to send anything. */
+  /* Takes ~ 130ms on my machine, by then the preliminary gate is about done. */
+  while (!usbcdc_configured());
+  while (gate_seq == 0);
 
-  /* The loop. */
-  uint32_t last_ms = 0;
+  uint32_t last_gate = gate_seq;
+  struct ui_reading r;
 
-  while (freq == 0);
+  /* A restored stream must not start with the screen. */
+  if (output == OUTPUT_SCREEN) {
+    reading_get(&r);
+    ui_redraw();
+    ui_render(&r);
+  }
 
-  /* The loop (for real). */
+  /* The loop. Output is produced once per finished gate, or right after a command. */
   while (true) {
-    // TODO: whether to support dividers? Any meaningful use?
-    poll_command();
+    bool update = poll_command();
+
+    if (usbcdc_connect_event() && (output == OUTPUT_SCREEN)) {
+      /* Host just opened the port and has not seen the labels. */
+      ui_redraw();
+      update = true;
+    }
 
     // TODO: currently missing 20 ticks out of 36,000,000 ticks (<0.6ppm error).
     //       However, before we use TCXO to supply clock to the MCU, fixing it will not improve precision.
 
-    usbcdc_clear_screen();
-
-    /* NOTE: Subtract one extra overflow (65536 ticks) occurred during counter reset. */
-    /* TODO: The following line costs approx. 20KB. Find an alternative if necessary. */
-    usbcdc_printf("%4lu.%06lu MHz %c [Hold: %s]\r\n\r\n",
-      (freq - 65536) / 1000000,
-      (freq - 65536) % 1000000,
-      gpio_get(GPIOB, GPIO1) ? '.' : ' ',
-      hold ? "ON " : "OFF"
-    );
+    if (output == OUTPUT_BINARY) {
+      stream_records();
+    }
 
-    usbcdc_printf("Clock output: %s\r\n", mco_name[mco_current]);
-    usbcdc_printf("Digital Filter: %s\r\n", filters_name[filter_current]);
-    usbcdc_printf("Pre-scaler: %s\r\n", prescalers_name[prescaler_current]);
+    if (gate_seq != last_gate) {
+      last_gate = gate_seq;
+      if (output == OUTPUT_TEXT) {
+        reading_get(&r);
+        ui_line(&r);
+      } else if (output == OUTPUT_SCREEN) {
+        update = true;
+      }
+    }
 
-    while (systick_ms < (last_ms + DISP_DELAY));
-    last_ms = systick_ms;
+    if (update && (output == OUTPUT_SCREEN)) {
+      reading_get(&r);
+      ui_render(&r);
+    }
   }
 
   return 0;
@@ -329,28 +648,119 @@ int main(void) {
 
 /* Interrupts */
 
+void tim3_isr(void) {
+  uint32_t start = dwt_read_cycle_counter();
+  uint32_t now, count;
+  int32_t  t;
+
+  timer_clear_flag(TIM3, TIM_SR_UIF);
+
+  /* Back to back, so that the delay between the two is the same for every sample. */
+  now   = dwt_read_cycle_counter();
+  count = gate_count();
+
+  t = (int32_t)(now - fit_t0) - (int32_t)(gate_ms * (AHB_HZ / 1000) / 2);
+  fit_n   ++;
+  fit_st  += t;
+  fit_sc  += count;
+  fit_stt += (int64_t)t * t;
+  fit_stc += (int64_t)t * count;
+
+  isr_cycles += dwt_read_cycle_counter() - start;
+}
+
 void tim2_isr(void) {
-  if (timer_get_flag(TIM2, TIM_SR_CC1IF)) {
+  uint32_t start = dwt_read_cycle_counter();
+
+  if (timer_get_flag(TIM2, TIM_SR_CC2IF)) {
     freq_scratch += 65536; /* TIM2 is 16-bit and overflows every 65536 events. */
-    timer_clear_flag(TIM2, TIM_SR_CC1IF); /* Clear interrupt flag. */
+    timer_clear_flag(TIM2, TIM_SR_CC2IF); /* Clear interrupt flag. */
+  }
+
+  isr_cycles += dwt_read_cycle_counter() - start;
+}
+
+static void record_push(uint32_t hz, uint16_t mhz, bool prelim) {
+  uint32_t next = (rec_head + 1) % REC_RING;
+  struct ui_reading r = {
+    .hz     = hz,
+    .mhz    = mhz,
+    .prelim = prelim,
+  };
+
+  if (next == rec_tail) {
+    /* Host not keeping up, the sequence gap tells it. */
+    rec_seq ++;
+    return;
   }
+
+  ui_record(&rec_ring[rec_head], &r, rec_seq ++, device_us());
+  rec_head = next;
 }
 
 void sys_tick_handler(void) {
+  uint32_t start = dwt_read_cycle_counter();
+
   systick_ms ++;
+  gate_elapsed ++;
 
-  if (systick_ms % 1000 == 0) {
+  if (gate_elapsed >= gate_ms) {
     /* Scratch pad to finalized result */
-    if (!hold) {
-      freq = freq_scratch + timer_get_counter(TIM2);
+    uint32_t count  = freq_scratch + timer_get_counter(TIM2);
+    uint16_t mhz    = 0;
+    uint64_t fit, cal;
+    bool     prelim = (gate_ms != gates_ms[gate_current]);
+
+    /* NOTE: Subtract one extra overflow (65536 ticks) occurred during counter reset. */
+    count = (count >= 65536) ? (count - 65536) : 0;
+    if ((estimator_current == EST_FIT) && fit_read(&fit)) {
+      /* Already per second. */
+      fit <<= prescaler_current;
+      if (count_current == COUNT_BOTH) {
+        fit /= 2;
+      }
+      count = fit / 1000;
+      mhz   = fit % 1000;
+    } else {
       if (prescaler_current)
-        freq *= (1 << prescaler_current);
+        count *= (1 << prescaler_current);
+      count *= 1000 / gate_ms;
+      if (count_current == COUNT_BOTH) {
+        /* Every period has one edge of each kind whatever the duty cycle, so halving is exact; odd leaves half a Hz. */
+        mhz    = (count & 1) ? 500 : 0;
+        count /= 2;
+      }
+    }
+    cal   = ui_calibrate((uint64_t)count * 1000 + mhz);
+    count = cal / 1000;
+    mhz   = cal % 1000;
+
+    gate_start();
+    gate_ms = gates_ms[gate_current];
+
+    /* Alarms keep watching the live signal while holding, but not the coarse reading of a short gate. */
+    if (!prelim) {
+      alarm_check(count);
+    }
+    if (output == OUTPUT_BINARY) {
+      record_push(count, mhz, prelim);
+    }
+    if (!hold) {
+      freq        = count;
+      freq_mhz    = mhz;
+      freq_prelim = prelim;
+    }
+    if (!hold && !prelim && count) {
+      stats_update(count);
+    } else {
+      /* Coarser resolution, or no signal at all, would only skew the statistics. */
+      stats_skip();
     }
-    /* Reset the counter. This will generate one extra overflow for next measurement. */
-    /* In case of nothing got counted, manually generate a reset to keep consistency. */
-    timer_set_counter(TIM2, 1);
-    timer_set_counter(TIM2, 0);
-    freq_scratch = 0;
     gpio_toggle(GPIOB, GPIO1);
+    gate_cycles = isr_cycles;
+    isr_cycles  = 0;
+    gate_seq ++;
   }
+
+  isr_cycles += dwt_read_cycle_counter() - start;
 }
@@ -0,0 +1,46 @@
+#ifndef __STM32_FREQMETER_PROTOCOL_H__
+#define __STM32_FREQMETER_PROTOCOL_H__
+
+#include <stdint.h>
+
+/*
+ * Binary stream (command 'b'): one record per finished gate, little-endian, 4 records per USB packet.
+ * Shared with the host tools in addons/.
+ */
+
+#define PROTO_SYNC        0xa5
+
+/* proto_record.flags */
+#define PROTO_FLAG_HOLD   0x01 /* Holding on the screen, hz is still the live reading. */
+#define PROTO_FLAG_PRELIM 0x02 /* Short first gate after power-up.                      */
+#define PROTO_FLAG_LOS    0x04 /* Alarms, see alarm.h.                                  */
+#define PROTO_FLAG_LIMIT  0x08
+#define PROTO_FLAG_RATE   0x10
+#define PROTO_FLAG_TIME   0x20 /* Reply to 't', time_us is now, seq is not consumed.   */
+#define PROTO_FLAG_BOTH   0x40 /* Both edges counted, mhz holds the half Hz.            */
+#define PROTO_FLAG_FIT    0x80 /* Least-squares estimate, mhz is resolved.              */
+
+struct proto_record {
+  uint8_t  sync;    /* PROTO_SYNC. */
+  uint8_t  flags;
+  uint16_t seq;     /* Gaps mean records were dropped on the device. */
+  uint32_t time_us; /* Device clock at gate close, wraps every ~71 minutes. */
+  uint32_t hz;
+  uint16_t mhz;     /* Fraction of hz in 1/1000, 0 unless the counting mode resolves it. */
+  uint16_t check;   /* See proto_check(). */
+} __attribute__((packed));
+
+/* Inverted sum of all half-words before check. */
+static inline uint16_t proto_check(const struct proto_record *rec) {
+  const uint8_t *p = (const uint8_t *)rec;
+  uint16_t sum = 0;
+  unsigned i;
+
+  for (i = 0; i < sizeof(*rec) - 2; i += 2) {
+    sum += p[i] | (p[i + 1] << 8);
+  }
+
+  return ~sum;
+}
+
+#endif /* __STM32_FREQMETER_PROTOCOL_H__ */
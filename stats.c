@@ -0,0 +1,182 @@
+#include <string.h>
+
+#include <libopencm3/cm3/cortex.h>
+
+#include "stats.h"
+
+/*
+ * Streaming statistics over consecutive readings, integer maths only.
+ *
+ * Mean and variance use Welford's update with the mean kept in Q48.16 Hz. The squared deviation accumulator
+ * is in Q16 Hz^2 and saturates for deviations beyond ~16MHz, hence resetting whenever the input setup changes.
+ *
+ * Overlapping Allan deviation is evaluated on the phase (running sum of readings): for tau = m gates the
+ * second difference x[k] - 2x[k - m] + x[k - 2m] is m times the difference of adjacent m-gate averages.
+ * Only the last 2 * STATS_ADEV_MMAX + 1 phase points are kept, so memory does not grow with the run. Points
+ * either side of a skipped reading are not adjacent in time, so the ring starts over after one.
+ */
+
+#define PHASE_RING (2 * STATS_ADEV_MMAX + 1)
+
+struct stats_acc {
+  uint32_t n;
+  uint32_t min;
+  uint32_t max;
+  int64_t  mean; /* Q48.16 Hz.    */
+  uint64_t m2;   /* Q48.16 Hz^2.  */
+  uint64_t adev_sum[STATS_ADEV_TAUS];
+  uint32_t adev_cnt[STATS_ADEV_TAUS];
+};
+
+static struct stats_acc acc;
+static uint32_t phase[PHASE_RING]; /* Modular, only differences are meaningful. */
+static uint32_t phase_acc = 0;
+static int      phase_head = 0;
+static int      phase_cnt  = 1;    /* phase[0] = 0 is the start of the first gate. */
+
+static uint32_t isqrt64(uint64_t x) {
+  uint64_t res = 0;
+  uint64_t bit = (uint64_t)1 << 62;
+
+  while (bit > x) {
+    bit >>= 2;
+  }
+  while (bit) {
+    if (x >= res + bit) {
+      x -= res + bit;
+      res = (res >> 1) + bit;
+    } else {
+      res >>= 1;
+    }
+    bit >>= 2;
+  }
+
+  return res;
+}
+
+/* sqrt(num / den) in Q24.8, den must be below 2^48. */
+static uint32_t sqrt_ratio_q8(uint64_t num, uint64_t den) {
+  uint64_t q = num / den;
+  uint64_t r = num % den;
+
+  if (q >= ((uint64_t)1 << 47)) {
+    return isqrt64(q) << 8;
+  }
+
+  return isqrt64((q << 16) + ((r << 16) / den));
+}
+
+void stats_reset(void) {
+  CM_ATOMIC_BLOCK() {
+    memset(&acc, 0, sizeof(acc));
+    phase[0]   = 0;
+    phase_acc  = 0;
+    phase_head = 0;
+    phase_cnt  = 1;
+  }
+}
+
+void stats_skip(void) {
+  CM_ATOMIC_BLOCK() {
+    phase[0]   = phase_acc;
+    phase_head = 0;
+    phase_cnt  = 1;
+  }
+}
+
+void stats_update(uint32_t hz) {
+  int64_t  x = (int64_t)hz << 16;
+  int64_t  d;
+  uint64_t a, b, sq;
+  int      i;
+
+  acc.n ++;
+  if (acc.n == 1) {
+    acc.mean = x;
+    acc.m2   = 0;
+    acc.min  = hz;
+    acc.max  = hz;
+  } else {
+    d = x - acc.mean;
+    acc.mean += d / (int64_t)acc.n;
+    /* Both deltas share the same sign, drop 8 fractional bits each and saturate rather than wrap. */
+    a = ((d < 0) ? -d : d) >> 8;
+    b = ((x < acc.mean) ? (acc.mean - x) : (x - acc.mean)) >> 8;
+    if (b && (a > UINT64_MAX / b)) {
+      acc.m2 = UINT64_MAX;
+    } else {
+      acc.m2 = (acc.m2 > UINT64_MAX - a * b) ? UINT64_MAX : (acc.m2 + a * b);
+    }
+
+    if (hz < acc.min) {
+      acc.min = hz;
+    }
+    if (hz > acc.max) {
+      acc.max = hz;
+    }
+  }
+
+  phase_acc += hz;
+  phase_head = (phase_head + 1) % PHASE_RING;
+  phase[phase_head] = phase_acc;
+  if (phase_cnt < PHASE_RING) {
+    phase_cnt ++;
+  }
+
+  for (i = 0; i < STATS_ADEV_TAUS; i ++) {
+    int     m = 1 << i;
+    int32_t d2;
+
+    if (phase_cnt <= 2 * m) {
+      break;
+    }
+
+    d2 = (int32_t)(phase[phase_head]
+                   - 2 * phase[(phase_head + PHASE_RING - m) % PHASE_RING]
+                   + phase[(phase_head + PHASE_RING - 2 * m) % PHASE_RING]);
+    sq = (uint64_t)((int64_t)d2 * d2);
+    acc.adev_sum[i] = (acc.adev_sum[i] > UINT64_MAX - sq) ? UINT64_MAX : (acc.adev_sum[i] + sq);
+    acc.adev_cnt[i] ++;
+  }
+}
+
+void stats_get(struct stats_result *res) {
+  struct stats_acc snap;
+  int i;
+
+  CM_ATOMIC_BLOCK() {
+    snap = acc;
+  }
+
+  res->n          = snap.n;
+  res->min        = snap.min;
+  res->max        = snap.max;
+  res->mean       = snap.mean >> 16;
+  res->mean_milli = ((snap.mean & 0xffff) * 1000) >> 16;
+  res->stddev_q8  = (snap.n > 1) ? isqrt64(snap.m2 / (snap.n - 1)) : 0;
+
+  for (i = 0; i < STATS_ADEV_TAUS; i ++) {
+    uint64_t m = 1 << i;
+
+    res->adev_n[i] = snap.adev_cnt[i];
+    if (snap.adev_cnt[i] == 0) {
+      res->adev_q8[i] = 0;
+    } else {
+      /* AVAR = sum(d2^2) / (2 * m^2 * count), in Hz^2 since every reading is already in Hz. */
+      res->adev_q8[i] = sqrt_ratio_q8(snap.adev_sum[i], 2 * m * m * snap.adev_cnt[i]);
+    }
+  }
+}
+
+uint32_t stats_relative_e12(uint32_t dev_q8, uint32_t hz) {
+  uint64_t e12;
+
+  if ((hz == 0) || (dev_q8 >= ((uint32_t)1 << 31))) {
+    return UINT32_MAX;
+  }
+
+  /* 1e12 / 256 = 3906250000 exactly. */
+  e12 = (uint64_t)dev_q8 * 3906250000ULL / hz;
+
+  return (e12 > UINT32_MAX) ? UINT32_MAX : e12;
+}
@@ -0,0 +1,32 @@
+#ifndef __STM32_FREQMETER_STATS_H__
+#define __STM32_FREQMETER_STATS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Allan deviation is evaluated at tau = 1, 2, 4, ... 2^(STATS_ADEV_TAUS - 1) gates. */
+#define STATS_ADEV_TAUS 5
+#define STATS_ADEV_MMAX (1 << (STATS_ADEV_TAUS - 1))
+
+struct stats_result {
+  uint32_t n;                        /* Number of readings since last reset.           */
+  uint32_t min;                      /* Hz.                                            */
+  uint32_t max;                      /* Hz.                                            */
+  uint32_t mean;                     /* Hz, integer part.                              */
+  uint16_t mean_milli;               /* Hz, fractional part in 1/1000.                 */
+  uint32_t stddev_q8;                /* Hz, Q24.8.                                     */
+  uint32_t adev_q8[STATS_ADEV_TAUS]; /* Allan deviation in Hz, Q24.8, needs n > 2 tau. */
+  uint32_t adev_n[STATS_ADEV_TAUS];  /* Terms behind each, 0 if not available yet.      */
+};
+
+void stats_reset(void);
+/* Called from the gate ISR once per finished reading. */
+void stats_update(uint32_t hz);
+/* Called from the gate ISR instead for a reading left out (hold, no signal, short gate): ADEV restarts its phase. */
+void stats_skip(void);
+/* Takes a consistent snapshot and derives the results. Call from main context only. */
+void stats_get(struct stats_result *res);
+/* Relative deviation in units of 1e-12, saturates at UINT32_MAX. */
+uint32_t stats_relative_e12(uint32_t dev_q8, uint32_t hz);
+
+#endif /* __STM32_FREQMETER_STATS_H__ */
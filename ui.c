@@ -0,0 +1,544 @@
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ui.h"
+#include "stats.h"
+#include "alarm.h"
+#include "clock.h"
+
+const uint32_t mco_hz[MCO_COUNT] = {
+  [MCO_OFF]      = 0,
+  [MCO_HSI]      = HSI_HZ,
+  [MCO_HSE]      = HSE_HZ,
+  [MCO_PLL_DIV2] = MCO_PLL_HZ,
+};
+
+/* Cutoff of each filter: the ETR input is sampled at f_DTS = TIM2 clock (CKD = 0), divided, N samples must agree. */
+#define FILTER_HZ(div, n) (TIM2_HZ / (div) / (n))
+const uint32_t filters_hz[FILTER_COUNT] = {
+  0,
+
+  FILTER_HZ( 1, 2),
+  FILTER_HZ( 1, 4),
+  FILTER_HZ( 1, 8),
+
+  FILTER_HZ( 2, 6),
+  FILTER_HZ( 2, 8),
+
+  FILTER_HZ( 4, 6),
+  FILTER_HZ( 4, 8),
+
+  FILTER_HZ( 8, 6),
+  FILTER_HZ( 8, 8),
+
+  FILTER_HZ(16, 5),
+  FILTER_HZ(16, 6),
+  FILTER_HZ(16, 8),
+
+  FILTER_HZ(32, 5),
+  FILTER_HZ(32, 6),
+  FILTER_HZ(32, 8),
+};
+
+const char *const prescalers_name[PRESCALER_COUNT] = {
+  "OFF",
+
+  "  2",
+  "  4",
+  "  8",
+};
+
+const char *const count_name[COUNT_MODES] = {
+  "rising edges",
+  "both edges",
+};
+
+const char *const estimator_name[ESTIMATORS] = {
+  "counter",
+  "least squares",
+};
+
+const uint32_t gates_ms[GATE_COUNT] = {
+  1000,
+  100,
+  10,
+  1,
+};
+
+int                       mco_current       = MCO_OFF;      /* Default to off.             */
+int                       filter_current    = 0;            /* Default to no filter.       */
+int                       prescaler_current = 0;            /* Default to no prescaler.    */
+int                       count_current     = COUNT_RISING;
+int                       estimator_current = EST_COUNTER;
+int                       gate_current      = 0;            /* Default to 1s.              */
+volatile bool             hold              = false;
+volatile int32_t          cal_ppb           = 0;
+volatile enum output_mode output            = OUTPUT_SCREEN;
+
+static uint32_t cmd_arg = 0; /* Numeric argument typed before a command, e.g. "8000100u". */
+static bool     cmd_neg = false;
+
+bool ui_printf(const char *fmt, ...) {
+  static char buffer[UI_LINE_SIZE];
+  int len;
+  va_list args;
+
+  /* TODO: The following line costs approx. 20KB. Find an alternative if necessary. */
+  va_start(args, fmt);
+  len = vsnprintf(buffer, sizeof(buffer), fmt, args);
+  va_end(args);
+
+  return ui_write(buffer, (len < (int)sizeof(buffer)) ? (size_t)len : sizeof(buffer) - 1);
+}
+
+/* Terminal screen: labels are drawn once, then only fields whose text changed are rewritten in place. */
+
+enum ui_field_id {
+  FIELD_FREQ,
+  FIELD_DOT,
+  FIELD_HOLD,
+  FIELD_FLAGS,
+  FIELD_MCO,
+  FIELD_FILTER,
+  FIELD_PRESCALER,
+  FIELD_EDGES,
+  FIELD_ESTIMATOR,
+  FIELD_GATE,
+  FIELD_CAL,
+  FIELD_ALARM,
+  FIELD_LIMITS,
+  FIELD_STATS_N,
+  FIELD_MEAN,
+  FIELD_STDDEV,
+  FIELD_MINMAX,
+  FIELD_ADEV,
+  FIELD_COUNT = FIELD_ADEV + STATS_ADEV_TAUS,
+};
+
+/* 1-based screen positions, must match the labels in ui_redraw(). */
+static const struct {
+  uint8_t row;
+  uint8_t col;
+} ui_fields[FIELD_ADEV + 1] = {
+  [FIELD_FREQ]      = { 1,  1},
+  [FIELD_DOT]       = { 1, 17},
+  [FIELD_HOLD]      = { 1, 26},
+  [FIELD_FLAGS]     = { 1, 31},
+  [FIELD_MCO]       = { 3, 15},
+  [FIELD_FILTER]    = { 4, 17},
+  [FIELD_PRESCALER] = { 5, 13},
+  [FIELD_EDGES]     = { 6, 11},
+  [FIELD_ESTIMATOR] = { 7, 12},
+  [FIELD_GATE]      = { 8, 12},
+  [FIELD_CAL]       = { 9, 14},
+  [FIELD_ALARM]     = {11,  8},
+  [FIELD_LIMITS]    = {12, 23},
+  [FIELD_STATS_N]   = {15, 12},
+  [FIELD_MEAN]      = {16, 12},
+  [FIELD_STDDEV]    = {17, 12},
+  [FIELD_MINMAX]    = {18, 12},
+  [FIELD_ADEV]      = {19, 12}, /* Followed by one row per tau. */
+};
+
+static char ui_cache[FIELD_COUNT][UI_FIELD_SIZE];
+
+static void ui_field(int id, const char *fmt, ...)
+__attribute__ ((format (printf, 2, 3)));
+
+static void ui_field(int id, const char *fmt, ...) {
+  char text[UI_FIELD_SIZE];
+  int  base = (id > FIELD_ADEV) ? FIELD_ADEV : id; /* ADEV rows share one entry. */
+  int  pad;
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(text, UI_FIELD_SIZE, fmt, args);
+  va_end(args);
+
+  if (0 == strcmp(text, ui_cache[id])) {
+    return;
+  }
+
+  /* Blank out whatever is left of a longer previous value. */
+  pad = (int)strlen(ui_cache[id]) - (int)strlen(text);
+  if (pad < 0) {
+    pad = 0;
+  }
+  /* Only cached once sent, so that a dropped update is retried on the next render. */
+  if (ui_printf("\033[%u;%uH%s%*s", ui_fields[base].row + (id - base), ui_fields[base].col, text, pad, "")) {
+    strcpy(ui_cache[id], text);
+  }
+}
+
+uint64_t ui_calibrate(uint64_t mhz) {
+  /* Whole Hz and the fraction apart, so that the products stay within 64 bits. */
+  int64_t corr = ((int64_t)(mhz / 1000) * cal_ppb + (int64_t)(mhz % 1000) * cal_ppb / 1000) / 1000000;
+
+  if ((corr < 0) && ((uint64_t)-corr > mhz)) {
+    return 0;
+  }
+  return mhz + corr;
+}
+
+void ui_hz_text(char *text, uint32_t hz) {
+  if (hz == 0) {
+    snprintf(text, UI_FIELD_SIZE, "%10s", "OFF");
+  } else if (hz >= 1000000) {
+    snprintf(text, UI_FIELD_SIZE, "%2" PRIu32 ".%03" PRIu32 " MHz", hz / 1000000, hz % 1000000 / 1000);
+  } else {
+    snprintf(text, UI_FIELD_SIZE, "%3" PRIu32 ".%02" PRIu32 " kHz", hz / 1000, hz % 1000 / 10);
+  }
+}
+
+void ui_mco_text(char *text, int mco) {
+  if (mco_hz[mco]) {
+    snprintf(text, UI_FIELD_SIZE, "%2" PRIu32 " MHz %s", mco_hz[mco] / 1000000, (mco == MCO_HSI) ? "RC" : "  ");
+  } else {
+    snprintf(text, UI_FIELD_SIZE, "%9s", "OFF");
+  }
+}
+
+void ui_redraw(void) {
+  int i;
+
+  /* Clear screen and hide cursor. */
+  ui_printf("\033[H\033[2J\033[?25l");
+
+  ui_printf("%11s MHz %c [Hold: %3s]\r\n\r\n", "", ' ', "");
+  ui_printf("Clock output:\r\nDigital Filter:\r\nPre-scaler:\r\nCounting:\r\nEstimator:\r\nGate time:\r\nCalibration:\r\n\r\n");
+  ui_printf("Alarm:\r\nLimits (Hz, 0 = off):\r\n\r\n");
+  ui_printf("Statistics:\r\nReadings:\r\nMean:\r\nStd. dev.:\r\nMin / Max:\r\n");
+  for (i = 0; i < STATS_ADEV_TAUS; i ++) {
+    ui_printf("ADEV(%2d):\r\n", 1 << i);
+  }
+
+  for (i = 0; i < FIELD_COUNT; i ++) {
+    ui_cache[i][0] = '\0';
+  }
+}
+
+void ui_render(const struct ui_reading *r) {
+  struct stats_result st;
+  uint8_t  state = alarm_get_state();
+  uint32_t e12;
+  char text[UI_FIELD_SIZE];
+  int i;
+
+  ui_field(FIELD_FREQ, "%4" PRIu32 ".%06" PRIu32, r->hz / 1000000, r->hz % 1000000);
+  ui_field(FIELD_DOT, "%c", r->dot ? '.' : ' ');
+  ui_field(FIELD_HOLD, "%s", hold ? "ON " : "OFF");
+  ui_field(FIELD_FLAGS, "%s", r->prelim ? "PRELIM" : "");
+
+  ui_mco_text(text, mco_current);
+  ui_field(FIELD_MCO, "%s", text);
+  ui_hz_text(text, filters_hz[filter_current]);
+  ui_field(FIELD_FILTER, "%s", text);
+  ui_field(FIELD_PRESCALER, "%s", prescalers_name[prescaler_current]);
+  ui_field(FIELD_EDGES, "%s", count_name[count_current]);
+  ui_field(FIELD_ESTIMATOR, "%s", estimator_name[estimator_current]);
+  ui_field(FIELD_GATE, "%4" PRIu32 " ms", gates_ms[gate_current]);
+  ui_field(FIELD_CAL, "%+" PRId32 " ppb", cal_ppb);
+
+  ui_field(FIELD_ALARM, "%s%s%s%s",
+    state ? "" : "OK",
+    (state & ALARM_LOS)   ? "LOS "   : "",
+    (state & ALARM_LIMIT) ? "LIMIT " : "",
+    (state & ALARM_RATE)  ? "RATE "  : ""
+  );
+  ui_field(FIELD_LIMITS, "lower %" PRIu32 ", upper %" PRIu32 ", rate %" PRIu32,
+    alarm_get_lower(),
+    alarm_get_upper(),
+    alarm_get_rate()
+  );
+
+  stats_get(&st);
+  ui_field(FIELD_STATS_N, "%" PRIu32, st.n);
+  if (st.n) {
+    ui_field(FIELD_MEAN, "%10" PRIu32 ".%03u Hz", st.mean, st.mean_milli);
+    ui_field(FIELD_STDDEV, "%10" PRIu32 ".%03" PRIu32 " Hz", st.stddev_q8 >> 8, ((st.stddev_q8 & 0xff) * 1000) >> 8);
+    ui_field(FIELD_MINMAX, "%10" PRIu32 " / %" PRIu32 " Hz", st.min, st.max);
+  } else {
+    ui_field(FIELD_MEAN, "%s", "");
+    ui_field(FIELD_STDDEV, "%s", "");
+    ui_field(FIELD_MINMAX, "%s", "");
+  }
+
+  for (i = 0; i < STATS_ADEV_TAUS; i ++) {
+    if (st.adev_n[i] == 0) {
+      /* Needs at least 2 * tau + 1 readings in a row. */
+      ui_field(FIELD_ADEV + i, "%s", "");
+      continue;
+    }
+    /* Relative to the mean, in ppb with 3 decimals. */
+    e12 = stats_relative_e12(st.adev_q8[i], st.mean);
+    ui_field(FIELD_ADEV + i, "%6" PRIu32 ".%03" PRIu32 " ppb", e12 / 1000, e12 % 1000);
+  }
+}
+
+void ui_enter(void) {
+  if (output == OUTPUT_SCREEN) {
+    ui_redraw();
+  } else if (output == OUTPUT_TEXT) {
+    /* Clear screen and show cursor. */
+    ui_printf("\033[H\033[2J\033[?25h");
+  }
+}
+
+bool ui_line(const struct ui_reading *r) {
+  bool     both = (count_current == COUNT_BOTH);
+  bool     fit  = (estimator_current == EST_FIT);
+  int      extra;
+  unsigned frac;
+
+  /* Same format as the first line of the screen, plus the decimals below 1 Hz that the mode resolves. */
+  extra = fit ? 3 : both ? 1 : 0;
+  frac  = fit ? r->mhz : both ? r->mhz / 100 : 0;
+  return ui_printf("%4" PRIu32 ".%06" PRIu32 "%.*u MHz %c [Hold: %s]%s%s%s\r\n",
+    r->hz / 1000000,
+    r->hz % 1000000,
+    extra, /* A precision of 0 prints nothing for 0. */
+    frac,
+    r->dot ? '.' : ' ',
+    hold ? "ON " : "OFF",
+    r->prelim ? " PRELIM" : "",
+    both ? " BOTH" : "",
+    fit ? " FIT" : ""
+  );
+}
+
+void ui_record(struct proto_record *rec, const struct ui_reading *r, uint16_t seq, uint32_t time_us) {
+  uint8_t alarm = alarm_get_state();
+
+  rec->sync    = PROTO_SYNC;
+  rec->flags   = (hold ? PROTO_FLAG_HOLD : 0)
+               | (r->prelim ? PROTO_FLAG_PRELIM : 0)
+               | ((alarm & ALARM_LOS)   ? PROTO_FLAG_LOS   : 0)
+               | ((alarm & ALARM_LIMIT) ? PROTO_FLAG_LIMIT : 0)
+               | ((alarm & ALARM_RATE)  ? PROTO_FLAG_RATE  : 0)
+               | ((count_current == COUNT_BOTH)  ? PROTO_FLAG_BOTH : 0)
+               | ((estimator_current == EST_FIT) ? PROTO_FLAG_FIT  : 0);
+  rec->seq     = seq;
+  rec->time_us = time_us;
+  rec->hz      = r->hz;
+  rec->mhz     = r->mhz;
+  rec->check   = proto_check(rec);
+}
+
+void config_collect(struct config *cfg) {
+  cfg->mco       = mco_current;
+  cfg->filter    = filter_current;
+  cfg->prescaler = prescaler_current;
+  cfg->gate      = gate_current;
+  cfg->flags     = (hold ? CONFIG_HOLD : 0)
+                 | ((output == OUTPUT_TEXT)   ? CONFIG_STREAM : 0)
+                 | ((output == OUTPUT_BINARY) ? CONFIG_BINARY : 0)
+                 | ((count_current == COUNT_BOTH) ? CONFIG_BOTH : 0)
+                 | ((estimator_current == EST_FIT) ? CONFIG_FIT : 0);
+  cfg->cal_ppb   = cal_ppb;
+}
+
+void config_apply(const struct config *cfg) {
+  /* Tables may have changed since the setup was saved. */
+  mco_current       = (cfg->mco       < MCO_COUNT)       ? cfg->mco       : 0;
+  filter_current    = (cfg->filter    < FILTER_COUNT)    ? cfg->filter    : 0;
+  prescaler_current = (cfg->prescaler < PRESCALER_COUNT) ? cfg->prescaler : 0;
+  gate_current      = (cfg->gate      < GATE_COUNT)      ? cfg->gate      : 0;
+  hold              = cfg->flags & CONFIG_HOLD;
+  output            = (cfg->flags & CONFIG_BINARY) ? OUTPUT_BINARY :
+                      (cfg->flags & CONFIG_STREAM) ? OUTPUT_TEXT   : OUTPUT_SCREEN;
+  cal_ppb           = cfg->cal_ppb;
+  count_current     = (cfg->flags & CONFIG_BOTH) ? COUNT_BOTH : COUNT_RISING;
+  estimator_current = (cfg->flags & CONFIG_FIT)  ? EST_FIT    : EST_COUNTER;
+  if (count_current == COUNT_BOTH) {
+    prescaler_current = 0;
+  }
+
+  ui_apply(UI_APPLY_ALL);
+  stats_reset();
+}
+
+enum ui_result ui_command(char *cmd, uint32_t *arg) {
+  struct config cfg;
+  bool neg;
+
+  if ((*cmd >= '0') && (*cmd <= '9')) {
+    /* Accumulate numeric argument for the next command. */
+    cmd_arg = cmd_arg * 10 + (*cmd - '0');
+    return UI_IDLE;
+  }
+
+  if (*cmd == '-') {
+    /* Only meaningful for signed arguments. */
+    cmd_neg = true;
+    return UI_IDLE;
+  }
+
+  *arg = cmd_arg;
+  neg  = cmd_neg;
+  cmd_arg = 0;
+  cmd_neg = false;
+
+  *cmd = tolower((unsigned char)*cmd);
+  switch (*cmd) {
+    case 'o': {
+      /* Switch MCO. */
+      mco_current = (mco_current + 1) % MCO_COUNT;
+      ui_apply(UI_APPLY_MCO);
+
+      return UI_UPDATE;
+    }
+
+    case 'h': {
+      /* Toggle hold. */
+      hold = !hold;
+
+      return UI_UPDATE;
+    }
+
+    case 'f': {
+      /* Configure digital filter. */
+      filter_current = (filter_current + 1) % FILTER_COUNT;
+      ui_apply(UI_APPLY_INPUT);
+      stats_reset();
+
+      return UI_UPDATE;
+    }
+
+    case 'p': {
+      /* Configure prescaler. Not in the path when counting both edges. */
+      if (count_current == COUNT_BOTH) {
+        return UI_IDLE;
+      }
+      prescaler_current = (prescaler_current + 1) % PRESCALER_COUNT;
+      ui_apply(UI_APPLY_INPUT);
+      stats_reset();
+
+      return UI_UPDATE;
+    }
+
+    case 'e': {
+      /* Count rising edges or both edges. */
+      count_current     = (count_current + 1) % COUNT_MODES;
+      prescaler_current = 0;
+      ui_apply(UI_APPLY_INPUT | UI_APPLY_COUNT);
+      stats_reset();
+
+      return UI_UPDATE;
+    }
+
+    case 'm': {
+      /* Switch between the counter and the least-squares estimator, fitting from the start of a gate. */
+      estimator_current = (estimator_current + 1) % ESTIMATORS;
+      ui_apply(UI_APPLY_ESTIMATOR | UI_APPLY_GATE);
+      stats_reset();
+
+      return UI_UPDATE;
+    }
+
+    case 'g': {
+      /* Switch gate time. */
+      gate_current = (gate_current + 1) % GATE_COUNT;
+      ui_apply(UI_APPLY_GATE);
+      stats_reset();
+
+      return UI_UPDATE;
+    }
+
+    case 'c': {
+      /* Calibration offset in ppb, e.g. "-150c". No argument to clear. */
+      cal_ppb = neg ? -(int32_t)*arg : (int32_t)*arg;
+      stats_reset();
+
+      return UI_UPDATE;
+    }
+
+    case 'w': {
+      /* Save current setup. On the device, ticks are lost while flash is busy. */
+      config_collect(&cfg);
+      config_save(&cfg);
+      ui_apply(UI_APPLY_GATE);
+
+      return UI_UPDATE;
+    }
+
+    case 'r': {
+      /* Restore saved setup. */
+      if (config_load(&cfg)) {
+        config_apply(&cfg);
+      }
+      ui_enter();
+
+      return UI_UPDATE;
+    }
+
+    case 'z': {
+      /* Restart statistics. */
+      stats_reset();
+
+      return UI_UPDATE;
+    }
+
+    case 'l': {
+      /* Lower frequency limit in Hz, no argument to disable. */
+      alarm_set_lower(*arg);
+
+      return UI_UPDATE;
+    }
+
+    case 'u': {
+      /* Upper frequency limit in Hz, no argument to disable. */
+      alarm_set_upper(*arg);
+
+      return UI_UPDATE;
+    }
+
+    case 'd': {
+      /* Rate-of-change limit in Hz per gate, no argument to disable. */
+      alarm_set_rate(*arg);
+
+      return UI_UPDATE;
+    }
+
+    case 's': {
+      /* Stream mode: one line per gate, for recording and other programs. */
+      output = OUTPUT_TEXT;
+      ui_apply(UI_APPLY_OUTPUT);
+      ui_enter();
+
+      return UI_IDLE;
+    }
+
+    case 'b': {
+      /* Binary stream: every reading, none skipped. */
+      output = OUTPUT_BINARY;
+      ui_apply(UI_APPLY_OUTPUT);
+
+      return UI_IDLE;
+    }
+
+    case 'v':
+    case '\f': {
+      /* Back to the screen, or redraw it (Ctrl-L). */
+      output = OUTPUT_SCREEN;
+      ui_apply(UI_APPLY_OUTPUT);
+      ui_redraw();
+
+      return UI_UPDATE;
+    }
+
+    case '\n':
+    case '\r': {
+      /* Remote echo for newline -- for convenient data recording. */
+      ui_write("\r", 1);
+
+      return UI_IDLE;
+    }
+
+    default: {
+      return UI_OTHER;
+    }
+  }
+}
@@ -0,0 +1,137 @@
+#ifndef __STM32_FREQMETER_UI_H__
+#define __STM32_FREQMETER_UI_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "config.h"
+#include "protocol.h"
+
+/*
+ * Setup, terminal screen, text stream and commands, shared by the firmware and the emulator (addons/fmemu),
+ * so that both behave the same. What differs is provided by each of them: ui_write() to reach the host,
+ * ui_apply() to set up the hardware, and config_load() / config_save() to keep the setup.
+ */
+
+#define UI_FIELD_SIZE 56    /* Fits the limits field, three 10-digit values with their labels. */
+#define UI_LINE_SIZE  256
+#define FIT_HZ        10000 /* Least-squares estimator: samples of the count per second. */
+
+/* Clock outputs, the firmware maps them to RCC_CFGR_MCO_*. */
+enum mco_source {
+  MCO_OFF,
+  MCO_HSI,
+  MCO_HSE,
+  MCO_PLL_DIV2,
+  MCO_COUNT,
+};
+
+#define FILTER_COUNT    16
+#define PRESCALER_COUNT 4
+#define GATE_COUNT      4
+
+/* Both edges are taken from TI1F_ED on the same pin, which bypasses the ETR prescaler. */
+enum count_mode {
+  COUNT_RISING,
+  COUNT_BOTH,
+  COUNT_MODES,
+};
+
+/*
+ * Counter: the count at the end of the gate, +/- 1 count.
+ * Least squares: the slope of FIT_HZ samples of the count against the cycle counter, finer by about the square
+ * root of the number of samples, and not affected by where the gate starts or ends.
+ */
+enum estimator {
+  EST_COUNTER,
+  EST_FIT,
+  ESTIMATORS,
+};
+
+enum output_mode {
+  OUTPUT_SCREEN,
+  OUTPUT_TEXT,   /* One text line per gate. */
+  OUTPUT_BINARY, /* One struct proto_record per gate. */
+};
+
+/* Option tables, indexed by the *_current values below. */
+extern const uint32_t    mco_hz[MCO_COUNT];             /* Output frequency, 0 for none. */
+extern const uint32_t    filters_hz[FILTER_COUNT];      /* Cutoff, 0 for no filter.      */
+extern const char *const prescalers_name[PRESCALER_COUNT];
+extern const char *const count_name[COUNT_MODES];
+extern const char *const estimator_name[ESTIMATORS];
+extern const uint32_t    gates_ms[GATE_COUNT];          /* Must divide 1000.             */
+
+/* Current setup. */
+extern int                       mco_current;
+extern int                       filter_current;
+extern int                       prescaler_current;
+extern int                       count_current;
+extern int                       estimator_current;
+extern int                       gate_current;
+extern volatile bool             hold;
+extern volatile int32_t          cal_ppb;
+extern volatile enum output_mode output;
+
+/* A finished gate, as shown to the host. */
+struct ui_reading {
+  uint32_t hz;
+  uint16_t mhz;    /* Fraction of hz in 1/1000, see count_name and estimator_name. */
+  bool     prelim; /* From the short first gate. */
+  bool     dot;    /* Activity indicator, in step with the LED. */
+};
+
+/* ui_apply() */
+#define UI_APPLY_MCO       0x01 /* mco_current.                                     */
+#define UI_APPLY_INPUT     0x02 /* filter_current, prescaler_current.               */
+#define UI_APPLY_COUNT     0x04 /* count_current.                                   */
+#define UI_APPLY_ESTIMATOR 0x08 /* estimator_current.                               */
+#define UI_APPLY_GATE      0x10 /* gate_current, also restarts the running gate.    */
+#define UI_APPLY_OUTPUT    0x20 /* output, e.g. drop what is queued for the old one. */
+#define UI_APPLY_ALL       0x3f
+
+/* Provided by the program: sends text to the host, false if it had to be dropped. */
+bool ui_write(const char *text, size_t len);
+/* Provided by the program: brings the hardware in line with the setup, UI_APPLY_* in the order listed. */
+void ui_apply(unsigned what);
+
+/* Result of ui_command(). */
+enum ui_result {
+  UI_IDLE,   /* Nothing to show, e.g. a digit of an argument. */
+  UI_UPDATE, /* The screen needs updating.                     */
+  UI_OTHER,  /* Not a shared command, left to the program.     */
+};
+
+/*
+ * Takes one character typed by the host. Digits and '-' accumulate the argument of the next command,
+ * e.g. "8000100u". For UI_OTHER, cmd is folded to lower case and arg holds its argument.
+ */
+enum ui_result ui_command(char *cmd, uint32_t *arg);
+
+bool ui_printf(const char *fmt, ...)
+__attribute__ ((format (printf, 1, 2)));
+
+/* Screen: labels are drawn once by ui_redraw(), then ui_render() only rewrites the fields that changed. */
+void ui_redraw(void);
+void ui_render(const struct ui_reading *r);
+/* Redraws the screen or clears it for the text stream, whichever output is selected. */
+void ui_enter(void);
+/* One text stream line. */
+bool ui_line(const struct ui_reading *r);
+/* Fills in a binary stream record. */
+void ui_record(struct proto_record *rec, const struct ui_reading *r, uint16_t seq, uint32_t time_us);
+
+/* Applies cal_ppb to a reading in mHz, so that the fraction below 1 Hz is corrected too. */
+uint64_t ui_calibrate(uint64_t mhz);
+
+/* Fixed width of 10, e.g. "36.000 MHz" or "281.25 kHz". */
+void ui_hz_text(char *text, uint32_t hz);
+/* Fixed width of 9, e.g. " 8 MHz RC". */
+void ui_mco_text(char *text, int mco);
+
+void config_collect(struct config *cfg);
+/* Also used at boot, right after the hardware is set up. */
+void config_apply(const struct config *cfg);
+
+#endif /* __STM32_FREQMETER_UI_H__ */
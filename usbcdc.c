@@ -1,6 +1,8 @@
 #include <stdlib.h>
+#include <stdbool.h>
 
 #include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/desig.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/cdc.h>
@@ -30,9 +32,10 @@ static const struct usb_device_descriptor dev = {
 };
 
 /*
- * This notification endpoint isn't implemented. According to CDC spec its
- * optional, but its absence causes a NULL pointer dereference in Linux
- * cdc_acm driver.
+ * This notification endpoint carries SERIAL_STATE notifications for alarms.
+ * According to CDC spec its optional, but its absence causes a NULL pointer
+ * dereference in Linux cdc_acm driver. Polled every frame so that alarms
+ * reach the host within 1ms.
  */
 static const struct usb_endpoint_descriptor comm_endp[] = {{
   .bLength            = USB_DT_ENDPOINT_SIZE,
@@ -40,7 +43,7 @@ static const struct usb_endpoint_descriptor comm_endp[] = {{
   .bEndpointAddress   = EP_INT,
   .bmAttributes       = USB_ENDPOINT_ATTR_INTERRUPT,
   .wMaxPacketSize     = 16,
-  .bInterval          = 255,
+  .bInterval          = 1,
 }};
 
 static const struct usb_endpoint_descriptor data_endp[] = {{
@@ -148,6 +151,34 @@ static const struct usb_config_descriptor config = {
 /* Buffer to be used for control requests. */
 static uint8_t usbd_control_buffer[128];
 
+static volatile bool     configured         = false;
+static volatile bool     dtr                = false;
+static volatile bool     connect_event      = false;
+static volatile uint16_t serial_state       = 0;
+static volatile bool     serial_state_dirty = false;
+
+static void cdcacm_send_serial_state(usbd_device *usbd_dev) {
+  char local_buf[10];
+  struct usb_cdc_notification *notif = (void *)local_buf;
+
+  notif->bmRequestType = 0xa1;
+  notif->bNotification = USB_CDC_NOTIFY_SERIAL_STATE;
+  notif->wValue        = 0;
+  notif->wIndex        = 0;
+  notif->wLength       = 2;
+  local_buf[8]         = serial_state & 0xff;
+  local_buf[9]         = serial_state >> 8;
+
+  /* Endpoint still busy with the previous one: retried on its completion. */
+  serial_state_dirty = (0 == usbd_ep_write_packet(usbd_dev, EP_INT, local_buf, sizeof(local_buf)));
+}
+
+static void cdcacm_int_complete(usbd_device *usbd_dev, uint8_t ep) {
+  if (serial_state_dirty) {
+    cdcacm_send_serial_state(usbd_dev);
+  }
+}
+
 static int cdcacm_control_request(usbd_device *usbd_dev, struct usb_setup_data *req, uint8_t **buf,
     uint16_t *len, void (**complete)(usbd_device *usbd_dev, struct usb_setup_data *req)) {
   switch (req->bRequest) {
@@ -157,17 +188,13 @@ static int cdcacm_control_request(usbd_device *usbd_dev, struct usb_setup_data *
      * even though it's optional in the CDC spec, and we don't
      * advertise it in the ACM functional descriptor.
      */
-    char local_buf[10];
-    struct usb_cdc_notification *notif = (void *)local_buf;
-
-    /* We echo signals back to host as notification. */
-    notif->bmRequestType = 0xa1;
-    notif->bNotification = USB_CDC_NOTIFY_SERIAL_STATE;
-    notif->wValue        = 0;
-    notif->wIndex        = 0;
-    notif->wLength       = 2;
-    local_buf[8]         = req->wValue & 3;
-    local_buf[9]         = 0;
+    if ((req->wValue & 1) && !dtr) {
+      connect_event = true;
+    }
+    dtr = req->wValue & 1;
+
+    /* Host (re)opened the port: tell it the current alarm state. */
+    cdcacm_send_serial_state(usbd_dev);
     return 1;
   }
   case USB_CDC_REQ_SET_LINE_CODING:
@@ -181,48 +208,98 @@ static int cdcacm_control_request(usbd_device *usbd_dev, struct usb_setup_data *
 static void cdcacm_set_config(usbd_device *usbd_dev, uint16_t wValue) {
   usbd_ep_setup(usbd_dev, EP_IN , USB_ENDPOINT_ATTR_BULK, 64, NULL);
   usbd_ep_setup(usbd_dev, EP_OUT, USB_ENDPOINT_ATTR_BULK, 64, NULL);
-  usbd_ep_setup(usbd_dev, EP_INT, USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
+  usbd_ep_setup(usbd_dev, EP_INT, USB_ENDPOINT_ATTR_INTERRUPT, 16, cdcacm_int_complete);
 
   usbd_register_control_callback(
         usbd_dev,
         USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
         USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
         cdcacm_control_request);
+
+  configured = true;
+}
+
+static void cdcacm_reset(void) {
+  configured = false;
+  dtr        = false;
 }
 
 static usbd_device *usbd_dev; /* Just a pointer, need not to be volatile. */
 
-/* Vendor, device, version. */
+/* 96-bit unique ID in hex, so that every meter keeps its own /dev/serial/by-id/ name. */
+static char usb_serial[25];
+
+/* Vendor, device, serial. */
 static const char *usb_strings[] = {
   "dword1511.info",
   "STM32-FREQMETER",
-  "20150516",
+  usb_serial,
 };
 
 void usbcdc_init(void) {
+  desig_get_unique_id_as_string(usb_serial, sizeof(usb_serial));
+
   usbd_dev = usbd_init(&st_usbfs_v1_usb_driver, &dev, &config, usb_strings, 3, usbd_control_buffer, sizeof(usbd_control_buffer));
   usbd_register_set_config_callback(usbd_dev, cdcacm_set_config);
+  usbd_register_reset_callback(usbd_dev, cdcacm_reset);
 
   /* NOTE: Must be called after USB setup since this enables calling usbd_poll(). */
   nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
   nvic_enable_irq(NVIC_USB_WAKEUP_IRQ);
 }
 
-uint16_t usbcdc_write(char* buf, size_t len) {
+uint16_t usbcdc_write(const char* buf, size_t len) {
   return usbd_ep_write_packet(usbd_dev, EP_OUT, buf, len);
 }
 
+void usbcdc_set_serial_state(uint16_t state) {
+  if (state == serial_state) {
+    return;
+  }
+
+  serial_state = state;
+  if (configured) {
+    cdcacm_send_serial_state(usbd_dev);
+  }
+}
+
+bool usbcdc_configured(void) {
+  return configured;
+}
+
+bool usbcdc_connect_event(void) {
+  if (!connect_event) {
+    return false;
+  }
+
+  connect_event = false;
+  return true;
+}
+
+/*
+ * Host input, one OUT packet at a time. A command with its argument, e.g. "8001000u", usually arrives in a single
+ * packet, so all of it is kept. The endpoint NAKs the next packet until this one is drained, nothing is dropped.
+ */
+static char     rx_buf[64];
+static uint16_t rx_len = 0;
+static uint16_t rx_pos = 0;
+
+bool usbcdc_has_input(void) {
+  if (rx_pos == rx_len) {
+    rx_len = usbd_ep_read_packet(usbd_dev, EP_IN, rx_buf, sizeof(rx_buf));
+    rx_pos = 0;
+  }
+
+  return rx_pos < rx_len;
+}
+
 /* '\0' is used to indicate empty buffer here. */
 char usbcdc_getc(void) {
-  int ret;
-  char c;
-
-  ret = usbd_ep_read_packet(usbd_dev, EP_IN, &c, 1);
-  if (0 == ret) {
+  if (!usbcdc_has_input()) {
     return '\0';
-  } else {
-    return c;
   }
+
+  return rx_buf[rx_pos ++];
 }
 
 /* Interrupts */
@@ -3,9 +3,24 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 void usbcdc_init(void);
-uint16_t usbcdc_write(char* buf, size_t len);
+uint16_t usbcdc_write(const char* buf, size_t len);
 char usbcdc_getc(void);
+/* Input is waiting, also when it is a '\0'. */
+bool usbcdc_has_input(void);
+/* Device has been configured by the host, writing is possible. */
+bool usbcdc_configured(void);
+/* True once after the host opened the port (DTR asserted). */
+bool usbcdc_connect_event(void);
+
+/* CDC SERIAL_STATE bits, seen by the host as modem lines (TIOCMGET / TIOCMIWAIT on Linux). */
+#define USBCDC_STATE_DCD 0x01
+#define USBCDC_STATE_DSR 0x02
+#define USBCDC_STATE_RI  0x08
+
+/* Pushes a notification on the interrupt endpoint when the state changes. Safe to call from ISRs. */
+void usbcdc_set_serial_state(uint16_t state);
 
 #endif /* __STM32_FREQMETER_USB_CDC_H__ */